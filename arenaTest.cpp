@@ -0,0 +1,66 @@
+#include <thread>
+
+#include "octTree.h"
+#include "initialConditions.h"
+
+// Rebuilds a tree in an arena with the lock-free insert() from several
+// threads at once, moving the particles a little between builds, and
+// fails if a build after the warm-up touches the heap or loses a
+// particle. Cells get their storage the first time they are used, so a
+// build that needs more blocks than any before it may allocate for
+// those. Run by ctest.
+
+size_t countParticles(const otNode* c) {
+  size_t n = c->nodes.size();
+  for (auto child : c->children)
+    n += countParticles(child);
+  return n;
+}
+
+int main() {
+  const size_t numNodes = 100000;
+  const int threshold = 16;
+  const int warmup = 3;
+  const int iterations = 20;
+  const int numThreads = 8;
+
+  vector<Node> nodes(numNodes);
+  initialConditions(nodes, CLUSTERS, 1);
+  float r = 40 * std::cbrt(float(numNodes));
+
+  otPool pool;
+  otNode root(threshold, &pool);
+  bool ok = true;
+  size_t mostBlocks = 0;
+  for (int i = 0; i < warmup + iterations; ++i) {
+    size_t allocations = pool.allocations;
+    pool.reset();
+    root.reset(threshold);
+    vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+      threads.emplace_back([&, t] {
+	  for (size_t k = t; k < nodes.size(); k += numThreads)
+	    root.insert(&nodes[k]);
+	});
+    for (auto& t : threads)
+      t.join();
+    root.updateStats(true);
+
+    size_t made = pool.allocations - allocations;
+    size_t held = countParticles(&root);
+    cout << "iteration " << i << " allocations " << made
+	 << " blocks " << pool.blocks() << " particles " << held << endl;
+    if ((i >= warmup && made != 0 && pool.blocks() <= mostBlocks) || held != numNodes)
+      ok = false;
+    mostBlocks = max(mostBlocks, pool.blocks());
+
+    // Move every particle up to 1% of the radius, so the next tree
+    // differs from this one.
+    for (auto& n : nodes) {
+      counterRng rng(i + 2, n.id);
+      n.position += rng.inBall(0.01f * r);
+    }
+  }
+  cout << (ok ? "ok" : "FAIL") << endl;
+  return ok ? 0 : 1;
+}
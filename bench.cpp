@@ -0,0 +1,416 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+using namespace std::chrono;
+
+#include <tbb/global_control.h>
+#include <tbb/task_arena.h>
+
+#include "octTree.h"
+#include "initialConditions.h"
+#include "directForce.h"
+
+// Benchmark suite. Sweeps particle count, leaf threshold and theta over
+// the standard initial conditions and tree modes, timing each phase of
+// an iteration separately, and reports median and percentile times plus
+// throughput as JSON or CSV so runs can be compared across builds.
+// With -a it also measures the force error of each configuration against
+// direct summation, so the cheapest settings within an error budget can
+// be picked from the same table. -L and -P pick the force laws and
+// precisions, each of which is its own instantiation of the tree. -j caps
+// the number of worker threads; locked is the insert mode through the
+// leaf mutexes, to compare against the lock-free insert(). -S picks the
+// seed of the initial conditions, the same on any number of threads.
+
+enum mode_e { INSERT, LOCKED, MORTON, TOPDOWN, SOA, GROUP };
+
+const char* modeName(mode_e m) {
+  switch (m) {
+  case INSERT: return "insert";
+  case LOCKED: return "locked";
+  case MORTON: return "morton";
+  case TOPDOWN: return "topdown";
+  case SOA: return "soa";
+  case GROUP: return "group";
+  }
+  return "unknown";
+}
+
+bool parseMode(const string& name, mode_e& m) {
+  for (auto c : { INSERT, LOCKED, MORTON, TOPDOWN, SOA, GROUP }) {
+    if (name == modeName(c)) {
+      m = c;
+      return true;
+    }
+  }
+  return false;
+}
+
+enum phase_e { BUILD, STATS, FORCES, UPDATE, NUM_PHASES };
+const char* phaseNames[NUM_PHASES] = { "build", "stats", "forces", "update" };
+
+struct phaseStats {
+  double median = 0;
+  double p10 = 0;
+  double p90 = 0;
+  double min = 0;
+  double max = 0;
+};
+
+// Nearest rank percentiles.
+phaseStats summarize(vector<double> t) {
+  phaseStats s;
+  if (t.empty())
+    return s;
+  std::sort(t.begin(), t.end());
+  auto pct = [&](double p) {
+    size_t i = size_t(std::ceil(p * t.size())) - (p > 0);
+    return t[min(i, t.size() - 1)];
+  };
+  s.median = pct(0.5);
+  s.p10 = pct(0.1);
+  s.p90 = pct(0.9);
+  s.min = t.front();
+  s.max = t.back();
+  return s;
+}
+
+struct benchResult {
+  distribution_e distribution;
+  mode_e mode;
+  const char* law;
+  const char* precision;
+  unsigned int n;
+  unsigned int threshold;
+  float theta;
+  unsigned int iterations;
+  int threads;
+  uint64_t seed;
+  phaseStats phases[NUM_PHASES];
+  phaseStats total;
+  double particlesPerSecond;
+  forceError error;
+};
+
+double since(high_resolution_clock::time_point& start) {
+  auto now = high_resolution_clock::now();
+  double s = duration<double>(now - start).count();
+  start = now;
+  return s;
+}
+
+template<typename Law>
+benchResult runConfig(distribution_e dist, mode_e mode, unsigned int n,
+		      unsigned int threshold, float theta,
+		      unsigned int warmup, unsigned int iterations, size_t samples,
+		      uint64_t seed) {
+  vector<Node> nodes(n);
+  initialConditions(nodes, dist, seed);
+  Particles particles;
+  bool soa = mode == SOA || mode == GROUP;
+  if (soa)
+    particles.fromNodes(nodes);
+
+  // The initial conditions start at rest, so after the first force pass
+  // each velocity is exactly the tree force on that particle.
+  vector<uint32_t> sample = sampleIndices(n, samples);
+  vector<glm::vec3> reference = directForces<Law>(nodes, sample);
+  vector<glm::vec3> treeForces;
+
+  otPoolT<Law> pool;
+  otNodeT<Law> root(threshold, &pool);
+  vector<double> times[NUM_PHASES];
+  vector<double> totals;
+
+  for (unsigned int i = 0; i < warmup + iterations; ++i) {
+    double t[NUM_PHASES];
+    auto start = high_resolution_clock::now();
+    pool.reset();
+    root.reset(threshold);
+    if (soa)
+      root.insertSorted(particles);
+    else if (mode == MORTON)
+      root.insertSorted(nodes);
+    else if (mode == TOPDOWN)
+      root.buildTopDown(nodes);
+    else
+      root.insertNodes(nodes, mode == LOCKED);
+    t[BUILD] = since(start);
+
+    root.updateStats(true, soa ? &particles : nullptr);
+    t[STATS] = since(start);
+
+    if (mode == GROUP)
+      root.calcForcesGrouped(particles, theta);
+    else if (soa)
+      root.calcForces(particles, theta);
+    else
+      root.calcForces(nodes, theta);
+    t[FORCES] = since(start);
+
+    if (i == 0 && !sample.empty()) {
+      vector<uint32_t> where(n);
+      for (uint32_t k = 0; k < n; ++k)
+	where[soa ? particles.id[k] : k] = k;
+      for (auto s : sample)
+	treeForces.push_back(soa ? particles.velocity(where[s]) : nodes[s].velocity);
+      start = high_resolution_clock::now();
+    }
+
+    if (soa)
+      root.updatePositions(particles);
+    else
+      root.updatePositions(nodes);
+    t[UPDATE] = since(start);
+
+    if (i < warmup)
+      continue;
+    double total = 0;
+    for (int p = 0; p < NUM_PHASES; ++p) {
+      times[p].push_back(t[p]);
+      total += t[p];
+    }
+    totals.push_back(total);
+  }
+
+  benchResult r;
+  r.distribution = dist;
+  r.mode = mode;
+  r.law = Law::name();
+  r.precision = Law::precision::name();
+  r.n = n;
+  r.threshold = threshold;
+  r.theta = theta;
+  r.iterations = iterations;
+  r.threads = tbb::this_task_arena::max_concurrency();
+  r.seed = seed;
+  for (int p = 0; p < NUM_PHASES; ++p)
+    r.phases[p] = summarize(times[p]);
+  r.total = summarize(totals);
+  r.particlesPerSecond = r.total.median > 0 ? n / r.total.median : 0;
+  r.error = compareForces(reference, treeForces);
+  return r;
+}
+
+const char* lawNames[] = { "mass", "plummer", "spline" };
+const char* precisionNames[] = { "float", "mixed", "double" };
+
+template<template<typename> class Law, typename... Args>
+benchResult runPrecision(const string& precision, Args... args) {
+  if (precision == "float")
+    return runConfig<Law<floatPrecision>>(args...);
+  if (precision == "double")
+    return runConfig<Law<doublePrecision>>(args...);
+  return runConfig<Law<mixedPrecision>>(args...);
+}
+
+template<typename... Args>
+benchResult runLaw(const string& law, const string& precision, Args... args) {
+  if (law == "plummer")
+    return runPrecision<plummerSoftened>(precision, args...);
+  if (law == "spline")
+    return runPrecision<splineSoftened>(precision, args...);
+  return runPrecision<massSoftened>(precision, args...);
+}
+
+bool known(const string& name, const char* const* names, size_t n) {
+  return std::find_if(names, names + n, [&](const char* c) { return name == c; }) != names + n;
+}
+
+void writeJson(ostream& out, const vector<benchResult>& results) {
+  auto stats = [&](const phaseStats& s) {
+    out << "{\"median\": " << s.median << ", \"p10\": " << s.p10
+	<< ", \"p90\": " << s.p90 << ", \"min\": " << s.min
+	<< ", \"max\": " << s.max << "}";
+  };
+  out << "[\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const benchResult& r = results[i];
+    out << "  {\"distribution\": \"" << distributionName(r.distribution) << "\""
+	<< ", \"mode\": \"" << modeName(r.mode) << "\""
+	<< ", \"law\": \"" << r.law << "\""
+	<< ", \"precision\": \"" << r.precision << "\""
+	<< ", \"n\": " << r.n
+	<< ", \"threshold\": " << r.threshold
+	<< ", \"theta\": " << r.theta
+	<< ", \"iterations\": " << r.iterations
+	<< ", \"threads\": " << r.threads
+	<< ", \"seed\": " << r.seed
+	<< ", \"particlesPerSecond\": " << r.particlesPerSecond;
+    if (r.error.samples)
+      out << ", \"samples\": " << r.error.samples
+	  << ", \"rmsError\": " << r.error.rms
+	  << ", \"maxError\": " << r.error.max;
+    out
+	<< ",\n   \"phases\": {";
+    for (int p = 0; p < NUM_PHASES; ++p) {
+      out << "\"" << phaseNames[p] << "\": ";
+      stats(r.phases[p]);
+      out << ", ";
+    }
+    out << "\"total\": ";
+    stats(r.total);
+    out << "}}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "]\n";
+}
+
+// One row per configuration and phase.
+void writeCsv(ostream& out, const vector<benchResult>& results) {
+  out << "distribution,mode,law,precision,n,threshold,theta,iterations,phase,"
+      << "median,p10,p90,min,max,particlesPerSecond,samples,rmsError,maxError,threads,seed\n";
+  for (auto& r : results) {
+    for (int p = 0; p <= NUM_PHASES; ++p) {
+      const phaseStats& s = p < NUM_PHASES ? r.phases[p] : r.total;
+      out << distributionName(r.distribution) << "," << modeName(r.mode) << ","
+	  << r.law << "," << r.precision << ","
+	  << r.n << "," << r.threshold << "," << r.theta << "," << r.iterations << ","
+	  << (p < NUM_PHASES ? phaseNames[p] : "total") << ","
+	  << s.median << "," << s.p10 << "," << s.p90 << ","
+	  << s.min << "," << s.max << "," << r.particlesPerSecond << ","
+	  << r.error.samples << "," << r.error.rms << "," << r.error.max << ","
+	  << r.threads << "," << r.seed << "\n";
+    }
+  }
+}
+
+vector<string> splitList(const char* s) {
+  vector<string> items;
+  stringstream ss(s);
+  string item;
+  while (getline(ss, item, ','))
+    if (!item.empty())
+      items.push_back(item);
+  return items;
+}
+
+int main(int argc, char* argv[]) {
+    vector<unsigned int> sizes = { 100000, 1000000 };
+    vector<unsigned int> thresholds = { 8, 32, 64 };
+    vector<float> thetas = { 0.7 };
+    vector<distribution_e> distributions = { BALL, DISK, PLUMMER, CLUSTERS };
+    vector<mode_e> modes = { INSERT, MORTON, TOPDOWN, GROUP };
+    unsigned int iterations = 10;
+    unsigned int warmup = 1;
+    size_t samples = 0;
+    vector<string> laws = { "mass" };
+    vector<string> precisions = { "mixed" };
+    string format = "json";
+    string outPath;
+    int threads = 0;
+    uint64_t seed = 0;
+
+    for (int cnt = 1; cnt + 1 < argc; cnt++)
+    {
+        if (strcmp(argv[cnt], "-n") == 0) {
+            sizes.clear();
+            for (auto& s : splitList(argv[cnt + 1]))
+                sizes.push_back(atoi(s.c_str()));
+        }
+        if (strcmp(argv[cnt], "-t") == 0) {
+            thresholds.clear();
+            for (auto& s : splitList(argv[cnt + 1]))
+                thresholds.push_back(atoi(s.c_str()));
+        }
+        if (strcmp(argv[cnt], "-e") == 0) {
+            thetas.clear();
+            for (auto& s : splitList(argv[cnt + 1]))
+                thetas.push_back(atof(s.c_str()));
+        }
+        if (strcmp(argv[cnt], "-D") == 0) {
+            distributions.clear();
+            for (auto& s : splitList(argv[cnt + 1])) {
+                distribution_e d;
+                if (!parseDistribution(s, d)) {
+                    cerr << "unknown distribution " << s << endl;
+                    return 1;
+                }
+                distributions.push_back(d);
+            }
+        }
+        if (strcmp(argv[cnt], "-x") == 0) {
+            modes.clear();
+            for (auto& s : splitList(argv[cnt + 1])) {
+                mode_e m;
+                if (!parseMode(s, m)) {
+                    cerr << "unknown mode " << s << endl;
+                    return 1;
+                }
+                modes.push_back(m);
+            }
+        }
+        if (strcmp(argv[cnt], "-L") == 0)
+            laws = splitList(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-P") == 0)
+            precisions = splitList(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-i") == 0)
+            iterations = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-w") == 0)
+            warmup = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-a") == 0)
+            samples = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-f") == 0)
+            format = argv[cnt + 1];
+        if (strcmp(argv[cnt], "-o") == 0)
+            outPath = argv[cnt + 1];
+        if (strcmp(argv[cnt], "-j") == 0)
+            threads = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-S") == 0)
+            seed = strtoull(argv[cnt + 1], nullptr, 0);
+    }
+    unique_ptr<tbb::global_control> parallelism;
+    if (threads > 0)
+        parallelism.reset(new tbb::global_control(tbb::global_control::max_allowed_parallelism,
+                                                  threads));
+    for (auto& l : laws) {
+        if (!known(l, lawNames, 3)) {
+            cerr << "unknown force law " << l << endl;
+            return 1;
+        }
+    }
+    for (auto& p : precisions) {
+        if (!known(p, precisionNames, 3)) {
+            cerr << "unknown precision " << p << endl;
+            return 1;
+        }
+    }
+    if (format != "json" && format != "csv") {
+        cerr << "unknown format " << format << ", expected json or csv" << endl;
+        return 1;
+    }
+
+    vector<benchResult> results;
+    for (auto d : distributions)
+      for (auto n : sizes)
+	for (auto t : thresholds)
+	  for (auto e : thetas)
+	    for (auto m : modes)
+	      for (auto& l : laws)
+		for (auto& pr : precisions) {
+		  results.push_back(runLaw(l, pr, d, m, n, t, e, warmup, iterations, samples, seed));
+		  // Progress goes to stderr so stdout stays machine readable.
+		  cerr << distributionName(d) << " " << modeName(m) << " " << l << " " << pr
+		       << " n " << n << " t " << t << " e " << e << " median "
+		       << results.back().total.median;
+		  if (samples)
+		    cerr << " rms " << results.back().error.rms
+			 << " max " << results.back().error.max;
+		  cerr << endl;
+		}
+
+    ofstream file;
+    if (!outPath.empty()) {
+        file.open(outPath);
+        if (!file) {
+            cerr << "cannot write " << outPath << endl;
+            return 1;
+        }
+    }
+    ostream& out = outPath.empty() ? cout : file;
+    if (format == "json")
+        writeJson(out, results);
+    else
+        writeCsv(out, results);
+    return 0;
+}
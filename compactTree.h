@@ -0,0 +1,150 @@
+#pragma once
+
+#include "octTree.h"
+
+// Compact copy of an SoA tree for the force walk. otNodeT carries all the
+// builds need, a lock, two vectors, the split center and so on, and its
+// children hang off pointers to cells anywhere in the heap, so a large
+// tree falls out of the last level cache long before the particles do.
+// The walk only needs each cell's moments, size and where its children or
+// particles are, which fits in 32 bytes. Every cell's non-empty children
+// are stored next to each other, so opening a cell touches one or two
+// cache lines. Quadrupoles, when there are any, live in a parallel array
+// that monopole walks never load.
+
+struct compactCell {
+  glm::vec3 baryCenter;
+  float weight;
+  float bboxSize;
+  float bmax;
+  uint32_t index;          // first child, or first particle of a leaf
+  uint32_t children : 4;   // number of children, 0 for a leaf
+  uint32_t count : 28;     // particles in a leaf
+};
+static_assert(sizeof(compactCell) == 32, "two compact cells per cache line");
+
+template<typename Law = defaultLaw>
+class compactTreeT {
+public:
+  typedef otNodeT<Law> tree_t;
+  typedef typename tree_t::accum_t accum_t;
+  typedef typename tree_t::geometricOpening geometricOpening;
+  typedef typename tree_t::relativeOpening relativeOpening;
+
+  vector<compactCell> cells;
+  vector<array<float, 6>> quads;   // only with order 2
+  int order = 1;
+
+  // Flatten a tree built by insertSorted(Particles&), after updateStats().
+  // The storage is kept from one build to the next.
+  void build(const tree_t& root) {
+    cells.clear();
+    quads.clear();
+    order = root.order;
+    if (root.weight == 0)
+      return;
+    cells.resize(1);
+    if (order > 1)
+      quads.resize(1);
+    flatten(root, 0);
+  }
+
+  void calcForces(Particles& p, float theta) {
+    if (cells.empty())
+      return;
+    std::for_each(std::execution::par_unseq, p.x.begin(), p.x.end(),
+		  [&](float& x) {
+		    INSTR_SCOPE("forces");
+		    size_t i = &x - p.x.data();
+		    glm::vec3 f(walk(p, i, 0, geometricOpening{ theta, order }));
+		    p.vx[i] += f.x;
+		    p.vy[i] += f.y;
+		    p.vz[i] += f.z;
+		  });
+  }
+  // See otNodeT::calcForces() with the same arguments.
+  void calcForces(Particles& p, float alpha, float theta, vector<float>& lastForce) {
+    if (cells.empty())
+      return;
+    lastForce.resize(p.size());
+    std::for_each(std::execution::par_unseq, p.x.begin(), p.x.end(),
+		  [&](float& x) {
+		    INSTR_SCOPE("forces");
+		    size_t i = &x - p.x.data();
+		    float& last = lastForce[p.id[i]];
+		    float limit = alpha * last / p.weight[i];
+		    accum_t f = last > 0 ? walk(p, i, 0, relativeOpening{ limit, order })
+		      : walk(p, i, 0, geometricOpening{ theta, order });
+		    p.vx[i] += f.x;
+		    p.vy[i] += f.y;
+		    p.vz[i] += f.z;
+		    last = glm::length(glm::vec3(f));
+		  });
+  }
+
+  template<typename Accept>
+  accum_t walk(const Particles& p, uint32_t n, uint32_t cell, const Accept& accept) const {
+    const compactCell& c = cells[cell];
+    if (c.children == 0) {
+      INSTR_COUNT(PARTICLE_INTERACTIONS, uint32_t(c.count));
+      return tree_t::leafForce(p, c.index, c.index + c.count, n);
+    }
+    glm::vec3 pos = p.position(n);
+    if (accept(c, pos)) {
+      INSTR_COUNT(CELL_INTERACTIONS, 1);
+      const float* quad = order > 1 ? quads[cell].data() : nullptr;
+      return tree_t::cellForce(pos, p.weight[n], c.baryCenter, c.weight, quad, order);
+    }
+    INSTR_COUNT(CELL_OPENINGS, 1);
+    accum_t f(0);
+    for (uint32_t k = 0; k < c.children; ++k)
+      f += walk(p, n, c.index + k, accept);
+    return f;
+  }
+
+  size_t bytes() const {
+    return cells.capacity() * sizeof(compactCell) + quads.capacity() * sizeof(quads[0]);
+  }
+
+  void debug(size_t particles) const {
+    cout << "debug compact cells " << cells.size()
+	 << " bytesPerParticle " << double(bytes()) / max<size_t>(particles, 1)
+	 << endl;
+  }
+
+private:
+  // Fill cells[slot] from c, then append c's children as one run.
+  void flatten(const tree_t& c, uint32_t slot) {
+    compactCell& cell = cells[slot];
+    cell.baryCenter = c.baryCenter;
+    cell.weight = c.weight;
+    cell.bboxSize = c.bboxSize;
+    cell.bmax = c.bmax;
+    cell.children = 0;
+    cell.index = c.first;
+    cell.count = c.count;
+    if (order > 1)
+      std::copy(c.quad, c.quad + 6, quads[slot].begin());
+    if (c.type == tree_t::LEAF)
+      return;
+
+    const tree_t* live[8];
+    uint32_t n = 0;
+    for (auto child : c.children) {
+      if (child->type == tree_t::NODE || child->leafSize() > 0)
+	live[n++] = child;
+    }
+    uint32_t index = cells.size();
+    cell.children = n;
+    cell.index = index;
+    cell.count = 0;
+    // cell is stale once cells grows.
+    cells.resize(index + n);
+    if (order > 1)
+      quads.resize(index + n);
+    for (uint32_t k = 0; k < n; ++k)
+      flatten(*live[k], index + k);
+  }
+};
+
+typedef compactTreeT<> compactTree;
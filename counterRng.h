@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1,
+// 2, 3", SC'11), a counter-based generator: every block of four words is
+// a pure function of a 128 bit counter and a 64 bit key. Particle i draws
+// from counter (i, stream, block), so what it gets depends on the seed
+// and i only, not on which thread fills it or in what order, and any
+// slice of the particles can be generated on its own.
+class counterRng {
+public:
+  counterRng(uint64_t seed, uint64_t index, uint32_t stream = 0)
+    : key{ uint32_t(seed), uint32_t(seed >> 32) },
+      counter{ uint32_t(index), uint32_t(index >> 32), stream, 0 } { }
+
+  uint32_t next() {
+    if (used == 4) {
+      block = philox(counter, key);
+      counter[3]++;
+      used = 0;
+    }
+    return block[used++];
+  }
+
+  static constexpr float twoPi = 6.2831853f;
+
+  // Uniform in [0, 1) with the full 24 bits of a float.
+  float uniform() { return (next() >> 8) * (1.0f / 16777216.0f); }
+  float uniform(float lo, float hi) { return lo + (hi - lo) * uniform(); }
+
+  glm::vec3 onSphere(float r) {
+    float z = uniform(-1.0f, 1.0f);
+    float phi = uniform(0.0f, twoPi);
+    float s = std::sqrt(std::max(0.0f, 1 - z * z));
+    return r * glm::vec3(s * std::cos(phi), s * std::sin(phi), z);
+  }
+  glm::vec3 inBall(float r) { return onSphere(r * std::cbrt(uniform())); }
+  glm::vec2 inDisk(float r) {
+    float rho = r * std::sqrt(uniform());
+    float phi = uniform(0.0f, twoPi);
+    return glm::vec2(rho * std::cos(phi), rho * std::sin(phi));
+  }
+
+  static std::array<uint32_t, 4> philox(std::array<uint32_t, 4> c,
+					  std::array<uint32_t, 2> k) {
+    for (int round = 0; round < 10; ++round) {
+      uint64_t p0 = uint64_t(0xD2511F53u) * c[0];
+      uint64_t p1 = uint64_t(0xCD9E8D57u) * c[2];
+      c = { uint32_t(p1 >> 32) ^ c[1] ^ k[0], uint32_t(p1),
+	    uint32_t(p0 >> 32) ^ c[3] ^ k[1], uint32_t(p0) };
+      k[0] += 0x9E3779B9u;
+      k[1] += 0xBB67AE85u;
+    }
+    return c;
+  }
+
+private:
+  std::array<uint32_t, 2> key;
+  std::array<uint32_t, 4> counter;
+  std::array<uint32_t, 4> block;
+  int used = 4;
+};
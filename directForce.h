@@ -0,0 +1,63 @@
+#pragma once
+
+#include "octTree.h"
+
+// Direct O(N^2) summation, the reference the tree forces are judged
+// against. It uses the tree's own force law, otNode's unless another one
+// is given, so any difference is down to the tree approximation and
+// never to the force law. Summing every pair is far too slow for a full
+// benchmark set, so only a sample of the particles is evaluated; each of
+// those sums over all N in double.
+
+struct forceError {
+  double rms = 0;       // RMS of |f - ref| / |ref| over the sample
+  double max = 0;       // largest relative error in the sample
+  size_t samples = 0;
+};
+
+// Evenly spaced sample of at most count particle indices.
+inline vector<uint32_t> sampleIndices(size_t n, size_t count) {
+  vector<uint32_t> sample;
+  if (n == 0 || count == 0)
+    return sample;
+  count = min(count, n);
+  sample.reserve(count);
+  for (size_t k = 0; k < count; ++k)
+    sample.push_back(uint32_t(k * n / count));
+  return sample;
+}
+
+template<typename Law = defaultLaw>
+inline glm::vec3 directForce(nodeArray nodes, uint32_t i) {
+  glm::dvec3 f(0);
+  const Node& n = nodes[i];
+  for (uint32_t j = 0; j < nodes.size(); ++j) {
+    if (j == i) continue;
+    f += glm::dvec3(Law::force(n.position, n.weight, nodes[j].position, nodes[j].weight));
+  }
+  return glm::vec3(f);
+}
+
+template<typename Law = defaultLaw>
+inline vector<glm::vec3> directForces(nodeArray nodes, const vector<uint32_t>& sample) {
+  vector<glm::vec3> f(sample.size());
+  std::transform(std::execution::par, sample.begin(), sample.end(), f.begin(),
+		 [&](uint32_t i) { return directForce<Law>(nodes, i); });
+  return f;
+}
+
+inline forceError compareForces(const vector<glm::vec3>& ref, const vector<glm::vec3>& f) {
+  forceError e;
+  double sum = 0;
+  for (size_t k = 0; k < ref.size() && k < f.size(); ++k) {
+    double r = glm::length(glm::dvec3(ref[k]));
+    if (r == 0) continue;
+    double rel = glm::length(glm::dvec3(f[k]) - glm::dvec3(ref[k])) / r;
+    sum += rel * rel;
+    e.max = std::max(e.max, rel);
+    e.samples++;
+  }
+  if (e.samples)
+    e.rms = std::sqrt(sum / e.samples);
+  return e;
+}
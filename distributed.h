@@ -0,0 +1,270 @@
+#pragma once
+
+#include <mpi.h>
+
+#include "octTree.h"
+
+// Distributed memory mode. Every rank owns a contiguous run of the
+// particles along the Morton curve of the global bounding box and builds
+// an ordinary otNode tree over them. Before the force pass each rank
+// sends every other rank its locally essential tree: the cells of its own
+// tree that are far enough from every part of the other rank's domain to
+// be taken as one mass, and the particles of the leaves that are not. The
+// receiver appends those as ghost particles, builds its tree over its own
+// particles plus the ghosts and only computes forces on its own
+// particles. Particles are rebalanced onto their new owners after every
+// position update.
+//
+// A stretch of the Morton curve is rarely a compact box, so each domain
+// is described to the others by the bboxes of about domainBoxes of its
+// top cells rather than by a single bbox.
+//
+// Particles travel as raw Node bytes, so all ranks must run the same
+// build. Node::id identifies particles across ranks.
+class domain {
+public:
+  MPI_Comm comm;
+  int rank = 0;
+  int size = 1;
+
+  static const size_t domainBoxes = 64;
+
+  // The boxes covering each rank's particles, from the last exchange().
+  vector<vector<bbox_t>> boxes;
+
+  // Cells and particles sent in the last exchange(), for reporting.
+  size_t sentCells = 0;
+  size_t sentParticles = 0;
+
+  domain(MPI_Comm c = MPI_COMM_WORLD) : comm(c) {
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+  }
+
+  // Move every particle to the rank owning its stretch of the Morton
+  // curve. The splitters come from a regular sample of every rank's
+  // sorted keys, so the ranks end up with close to equal counts.
+  void balance(vector<Node>& local) {
+    bbox_t global = globalBounds(local);
+    glm::vec3 extent = global.max - global.min;
+    float cube = max(max(extent.x, extent.y), extent.z);
+    if (cube <= 0.0f)
+      cube = 1.0f;
+    float scale = float(1 << otNode::mortonLevels) / cube;
+
+    vector<uint64_t> keys(local.size());
+    std::transform(std::execution::par_unseq, local.begin(), local.end(), keys.begin(),
+		   [&](const Node& n) {
+		     return otNode::mortonKey(n.position, global.min, scale);
+		   });
+
+    // Regular sampling: oversample times size keys from every rank.
+    const size_t oversample = 16;
+    vector<uint64_t> sorted(keys);
+    std::sort(std::execution::par_unseq, sorted.begin(), sorted.end());
+    vector<uint64_t> sample;
+    size_t want = min(sorted.size(), oversample * size);
+    for (size_t k = 0; k < want; ++k)
+      sample.push_back(sorted[k * sorted.size() / want]);
+    vector<uint64_t> samples = allgatherv(sample);
+    std::sort(samples.begin(), samples.end());
+    vector<uint64_t> splitters;
+    for (int r = 1; r < size; ++r)
+      splitters.push_back(samples.empty() ? 0 : samples[r * samples.size() / size]);
+
+    vector<int> dest(local.size());
+    std::transform(std::execution::par_unseq, keys.begin(), keys.end(), dest.begin(),
+		   [&](uint64_t k) {
+		     return int(std::upper_bound(splitters.begin(), splitters.end(), k) -
+				splitters.begin());
+		   });
+    local = alltoallv(local, dest);
+  }
+
+  // Send every other rank the part of our tree it needs and return our
+  // particles followed by the ghosts received from everyone else. root
+  // must be built over local with its stats up to date.
+  vector<Node> exchange(const otNode& root, const vector<Node>& local, float theta) {
+    vector<bbox_t> mine;
+    cover(&root, max(local.size() / domainBoxes, size_t(root.threshold)), mine);
+    vector<int> counts;
+    vector<bbox_t> all = allgatherv(mine, &counts);
+    boxes.assign(size, vector<bbox_t>());
+    for (int r = 0, k = 0; r < size; k += counts[r++])
+      boxes[r].assign(all.begin() + k, all.begin() + k + counts[r]);
+
+    vector<Node> out;
+    vector<int> dest;
+    sentCells = sentParticles = 0;
+    for (int r = 0; r < size; ++r) {
+      if (r == rank || boxes[r].empty())
+	continue;
+      size_t before = out.size();
+      essential(&root, boxes[r], theta, out);
+      dest.resize(out.size(), r);
+      sentParticles += out.size() - before;
+    }
+    sentParticles -= sentCells;
+
+    vector<Node> particles(local);
+    vector<Node> ghosts = alltoallv(out, dest);
+    particles.insert(particles.end(), ghosts.begin(), ghosts.end());
+    return particles;
+  }
+
+  // All particles on rank 0, ordered by id; empty elsewhere.
+  vector<Node> gather(const vector<Node>& local) {
+    vector<Node> all = gatherv(local);
+    std::sort(all.begin(), all.end(),
+	      [](const Node& a, const Node& b) { return a.id < b.id; });
+    return all;
+  }
+
+  // Hand out rank 0's particles in equal slices.
+  vector<Node> scatter(const vector<Node>& all) {
+    vector<int> dest(all.size());
+    for (size_t i = 0; i < all.size(); ++i)
+      dest[i] = int(i * size / all.size());
+    return alltoallv(all, dest);
+  }
+
+  double maxOver(double v) {
+    double m;
+    MPI_Allreduce(&v, &m, 1, MPI_DOUBLE, MPI_MAX, comm);
+    return m;
+  }
+  size_t sumOver(size_t v) {
+    uint64_t in = v, s;
+    MPI_Allreduce(&in, &s, 1, MPI_UINT64_T, MPI_SUM, comm);
+    return s;
+  }
+
+private:
+  // Boxes of the highest cells holding at most limit particles.
+  void cover(const otNode* c, size_t limit, vector<bbox_t>& out) {
+    if (c->type == otNode::LEAF || c->count <= limit) {
+      if (c->weight > 0)
+	out.push_back(c->bbox);
+      return;
+    }
+    for (auto& child : c->children)
+      cover(child, limit, out);
+  }
+
+  // Walk the tree against a remote domain the way interactions() walks it
+  // against a leaf bucket, using the nearest of the domain's boxes.
+  // Accepted cells go out as a single particle of the cell's mass at its
+  // baryCenter, with id ~0.
+  void essential(const otNode* c, const vector<bbox_t>& remote, float theta,
+		 vector<Node>& out) {
+    if (c->type == otNode::NODE) {
+      float nearest = numeric_limits<float>::max();
+      for (auto& b : remote) {
+	glm::vec3 gap = glm::max(glm::max(b.min - c->baryCenter, c->baryCenter - b.max),
+				 glm::vec3(0));
+	nearest = min(nearest, glm::length(gap));
+      }
+      if (nearest / c->bboxSize > theta) {
+	Node n;
+	n.position = c->baryCenter;
+	n.weight = c->weight;
+	n.velocity = glm::vec3(0);
+	n.id = ~0u;
+	out.push_back(n);
+	sentCells++;
+      }
+      else {
+	for (auto& child : c->children)
+	  essential(child, remote, theta, out);
+      }
+    }
+    else {
+      for (auto n : c->nodes)
+	out.push_back(*n);
+    }
+  }
+
+  bbox_t globalBounds(const vector<Node>& local) {
+    float lo[3] = { numeric_limits<float>::max(), numeric_limits<float>::max(),
+		    numeric_limits<float>::max() };
+    float hi[3] = { -lo[0], -lo[1], -lo[2] };
+    for (auto& n : local) {
+      for (int a = 0; a < 3; ++a) {
+	lo[a] = min(lo[a], n.position[a]);
+	hi[a] = max(hi[a], n.position[a]);
+      }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, lo, 3, MPI_FLOAT, MPI_MIN, comm);
+    MPI_Allreduce(MPI_IN_PLACE, hi, 3, MPI_FLOAT, MPI_MAX, comm);
+    bbox_t b;
+    b += glm::vec3(lo[0], lo[1], lo[2]);
+    b += glm::vec3(hi[0], hi[1], hi[2]);
+    return b;
+  }
+
+  // Send items[i] to rank dest[i] and return what everyone sent us, in
+  // rank order.
+  vector<Node> alltoallv(const vector<Node>& items, const vector<int>& dest) {
+    vector<int> sendCounts(size, 0), recvCounts(size);
+    for (auto d : dest)
+      sendCounts[d]++;
+    MPI_Alltoall(sendCounts.data(), 1, MPI_INT, recvCounts.data(), 1, MPI_INT, comm);
+
+    vector<int> sendOffsets(size, 0), recvOffsets(size, 0);
+    for (int r = 1; r < size; ++r) {
+      sendOffsets[r] = sendOffsets[r - 1] + sendCounts[r - 1];
+      recvOffsets[r] = recvOffsets[r - 1] + recvCounts[r - 1];
+    }
+    vector<Node> send(items.size());
+    vector<int> fill(sendOffsets);
+    for (size_t i = 0; i < items.size(); ++i)
+      send[fill[dest[i]]++] = items[i];
+    vector<Node> recv(recvOffsets[size - 1] + recvCounts[size - 1]);
+
+    MPI_Datatype type = bytesType<Node>();
+    MPI_Alltoallv(send.data(), sendCounts.data(), sendOffsets.data(), type,
+		  recv.data(), recvCounts.data(), recvOffsets.data(), type, comm);
+    MPI_Type_free(&type);
+    return recv;
+  }
+
+  vector<Node> gatherv(const vector<Node>& local) {
+    int count = local.size();
+    vector<int> counts(size), offsets(size, 0);
+    MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, comm);
+    for (int r = 1; r < size; ++r)
+      offsets[r] = offsets[r - 1] + counts[r - 1];
+    vector<Node> all(rank == 0 ? offsets[size - 1] + counts[size - 1] : 0);
+    MPI_Datatype type = bytesType<Node>();
+    MPI_Gatherv(local.data(), count, type, all.data(), counts.data(), offsets.data(),
+		type, 0, comm);
+    MPI_Type_free(&type);
+    return all;
+  }
+
+  // Everyone's items in rank order, and how many came from each rank.
+  template<typename T>
+  vector<T> allgatherv(const vector<T>& local, vector<int>* countsOut = nullptr) {
+    int count = local.size();
+    vector<int> counts(size), offsets(size, 0);
+    MPI_Allgather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, comm);
+    for (int r = 1; r < size; ++r)
+      offsets[r] = offsets[r - 1] + counts[r - 1];
+    vector<T> all(offsets[size - 1] + counts[size - 1]);
+    MPI_Datatype type = bytesType<T>();
+    MPI_Allgatherv(local.data(), count, type, all.data(), counts.data(), offsets.data(),
+		   type, comm);
+    MPI_Type_free(&type);
+    if (countsOut)
+      *countsOut = counts;
+    return all;
+  }
+
+  template<typename T>
+  static MPI_Datatype bytesType() {
+    MPI_Datatype type;
+    MPI_Type_contiguous(sizeof(T), MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+    return type;
+  }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cmath>
+#include <type_traits>
+
+#include <glm/glm.hpp>
+
+// Compile time policies for the pairwise force. A law is a struct with a
+// static force(p1, m1, p2, m2) giving the force on m1 at p1 from m2 at p2
+// as an accum_t, the vector type the tree walks sum forces in, and a
+// name() for reports. otNodeT
+// takes one as its template argument, so every walk and leaf loop is
+// specialised and inlined for it with no branches at run time.
+//
+// Particles are always stored in float; the precision policy only picks
+// what the arithmetic is done in:
+//
+//   floatPrecision   everything in float
+//   mixedPrecision   float vectors, double magnitudes, as force() always was
+//   doublePrecision  everything in double, including the walk's sums
+
+struct floatPrecision {
+  typedef float vector_t;
+  typedef float scalar_t;
+  static const char* name() { return "float"; }
+};
+
+struct mixedPrecision {
+  typedef float vector_t;
+  typedef double scalar_t;
+  static const char* name() { return "mixed"; }
+};
+
+struct doublePrecision {
+  typedef double vector_t;
+  typedef double scalar_t;
+  static const char* name() { return "double"; }
+};
+
+// Our own law, m1 m2 / (r^2 + sqrt(m1 + m2)), softened by the masses.
+template<typename P>
+struct massSoftened {
+  typedef P precision;
+  typedef typename P::vector_t T;
+  typedef typename P::scalar_t S;
+  typedef glm::vec<3, T> accum_t;
+
+  // leafKernel.h implements this law in float.
+  static constexpr bool leafKernels = std::is_same<T, float>::value;
+
+  static const char* name() { return "mass"; }
+
+  static accum_t force(const glm::vec3& p1, float m1, const glm::vec3& p2, float m2) {
+    glm::vec<3, T> d = glm::vec<3, T>(p2) - glm::vec<3, T>(p1);
+    S r = glm::length(d);
+    T f = S(T(m1) * T(m2)) / ((r * r) + S(std::sqrt(T(m1) + T(m2))));
+    return glm::normalize(d) * f;
+  }
+};
+
+// Plummer softening, m1 m2 r / (r^2 + eps^2)^(3/2).
+template<typename P>
+struct plummerSoftened {
+  typedef P precision;
+  typedef typename P::vector_t T;
+  typedef typename P::scalar_t S;
+  typedef glm::vec<3, T> accum_t;
+
+  static constexpr bool leafKernels = false;
+  static constexpr float softening = 1.0f;
+
+  static const char* name() { return "plummer"; }
+
+  static accum_t force(const glm::vec3& p1, float m1, const glm::vec3& p2, float m2) {
+    glm::vec<3, T> d = glm::vec<3, T>(p2) - glm::vec<3, T>(p1);
+    S r2 = glm::dot(d, d) + S(softening) * S(softening);
+    T f = S(T(m1) * T(m2)) / (r2 * std::sqrt(r2));
+    return d * f;
+  }
+};
+
+// Cubic spline softening as in GADGET: exactly Newtonian beyond
+// h = 2.8 eps, a smooth kernel inside it.
+template<typename P>
+struct splineSoftened {
+  typedef P precision;
+  typedef typename P::vector_t T;
+  typedef typename P::scalar_t S;
+  typedef glm::vec<3, T> accum_t;
+
+  static constexpr bool leafKernels = false;
+  static constexpr float softening = 1.0f;
+
+  static const char* name() { return "spline"; }
+
+  static accum_t force(const glm::vec3& p1, float m1, const glm::vec3& p2, float m2) {
+    glm::vec<3, T> d = glm::vec<3, T>(p2) - glm::vec<3, T>(p1);
+    S r = glm::length(d);
+    S h = S(2.8) * S(softening);
+    S fac;
+    if (r >= h) {
+      fac = 1 / (r * r * r);
+    }
+    else {
+      S u = r / h;
+      S h3 = 1 / (h * h * h);
+      if (u < S(0.5))
+	fac = h3 * (S(10.666666666667) + u * u * (S(32.0) * u - S(38.4)));
+      else
+	fac = h3 * (S(21.333333333333) - S(48.0) * u + S(38.4) * u * u -
+		    S(10.666666666667) * u * u * u - S(0.066666666667) / (u * u * u));
+    }
+    return d * T(fac * S(T(m1) * T(m2)));
+  }
+};
+
+// What otNode has always used.
+typedef massSoftened<mixedPrecision> defaultLaw;
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+
+#include "octTree.h"
+#include "counterRng.h"
+
+// Standard initial conditions for benchmarks. All of them scale their
+// radius with cbrt(N) so the density stays comparable as N grows. The
+// same seed gives the same particles on any number of threads or ranks.
+enum distribution_e { BALL, DISK, PLUMMER, CLUSTERS };
+
+inline const char* distributionName(distribution_e d) {
+  switch (d) {
+  case BALL: return "ball";
+  case DISK: return "disk";
+  case PLUMMER: return "plummer";
+  case CLUSTERS: return "clusters";
+  }
+  return "unknown";
+}
+
+inline bool parseDistribution(const string& name, distribution_e& d) {
+  for (auto c : { BALL, DISK, PLUMMER, CLUSTERS }) {
+    if (name == distributionName(c)) {
+      d = c;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Radius of a Plummer sphere with scale a, truncated at 10a so a few
+// stray particles do not blow the bounding box up.
+inline float plummerRadius(counterRng& rng, float a) {
+  float r;
+  do {
+    float u = rng.uniform(1e-6f, 1.0f);
+    r = a / std::sqrt(std::pow(u, -2.0f / 3.0f) - 1.0f);
+  } while (r > 10 * a);
+  return r;
+}
+
+// Fill nodes, in parallel, with particles first to first + nodes.size()
+// of a total particle draw with this seed. total 0 means nodes is all of
+// it; a rank or a restart can fill just its own slice and get the same
+// particles, ids included, as a single full draw.
+inline void initialConditions(nodeArray nodes, distribution_e d, uint64_t seed = 0,
+			      size_t first = 0, size_t total = 0) {
+  if (total == 0)
+    total = nodes.size();
+  const float r = 40 * std::cbrt(float(total));
+  const int numHalos = 8;
+  glm::vec3 halos[numHalos];
+  counterRng haloRng(seed, 0, 1);
+  for (auto& h : halos)
+    h = haloRng.inBall(r);
+
+  std::for_each(std::execution::par_unseq, nodes.begin(), nodes.end(),
+		[&](Node& n) {
+		  size_t i = first + (&n - nodes.data());
+		  counterRng rng(seed, i);
+		  switch (d) {
+		  case BALL:
+		    n.position = rng.inBall(r);
+		    break;
+		  case DISK:
+		    n.position = glm::vec3(rng.inDisk(r), 1.0);
+		    break;
+		  case PLUMMER:
+		    n.position = rng.onSphere(plummerRadius(rng, r / 4));
+		    break;
+		  case CLUSTERS:
+		    // Plummer halos of different sizes scattered through the ball.
+		    {
+		      int h = int(rng.uniform() * numHalos) % numHalos;
+		      n.position = halos[h] + rng.onSphere(plummerRadius(rng, r / (8 + 4 * h)));
+		    }
+		    break;
+		  }
+		  n.weight = glm::fastExp(rng.uniform(0.0f, 6.0f));
+		  n.velocity = glm::vec3(0.0f);
+		  n.id = i;
+		});
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// Instrumentation for the tree passes. Build with -DOCTTREE_INSTRUMENT to
+// get work counters, per thread busy time in each parallel region and a
+// Chrome trace_event dump (load it in chrome://tracing or Perfetto).
+// Without it every macro below expands to nothing, or to the plain lock,
+// and the functions are empty inlines, so the hooks can stay in the code.
+//
+//   INSTR_COUNT(counter, n)  add n to a per thread counter
+//   INSTR_SCOPE(name)        time the enclosing block as work in region name
+//   INSTR_LOCK(mutex)        lock, counting the times we had to wait
+//
+// Top level phases are marked with instrument::mark(name), which closes
+// the phase that started at the previous mark, the same way printTimer()
+// reports them.
+//
+// Counters and events are kept per thread and only merged when reported,
+// so the hot paths never share a cache line.
+
+namespace instrument {
+
+enum counter_e {
+  CELL_OPENINGS,          // cells walked into instead of accepted
+  CELL_INTERACTIONS,      // particle-cell forces
+  PARTICLE_INTERACTIONS,  // particle-particle forces
+  INSERT_LOCKS,           // leaf locks taken in insertLocked()
+  INSERT_LOCK_WAITS,      // ... that were already held
+  SPLIT_HELPS,            // splits built by a thread that found the leaf full
+  SPLIT_DISCARDS,         // ... and lost the race to publish
+  NUM_COUNTERS
+};
+
+inline const char* counterName(int c) {
+  static const char* names[NUM_COUNTERS] = {
+    "cellOpenings", "cellInteractions", "particleInteractions",
+    "insertLocks", "insertLockWaits", "splitHelps", "splitDiscards"
+  };
+  return names[c];
+}
+
+} // namespace instrument
+
+#ifdef OCTTREE_INSTRUMENT
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace instrument {
+
+const bool enabled = true;
+
+struct traceEvent {
+  const char* name;
+  double begin;   // microseconds since beginIteration()
+  double end;
+};
+
+struct threadData {
+  int tid = 0;
+  int depth = 0;
+  uint64_t counters[NUM_COUNTERS] = {};
+  std::vector<std::pair<const char*, double>> busy;  // region, microseconds
+  std::vector<traceEvent> events;
+
+  void addBusy(const char* name, double us) {
+    for (auto& b : busy) {
+      if (b.first == name) {
+	b.second += us;
+	return;
+      }
+    }
+    busy.push_back(std::make_pair(name, us));
+  }
+};
+
+struct phaseEvent {
+  std::string name;
+  double begin;
+  double end;
+};
+
+struct registry {
+  std::mutex lock;
+  std::vector<std::unique_ptr<threadData>> threads;
+  std::vector<phaseEvent> phases;
+  std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+  double lastMark = 0;
+  bool tracing = false;
+};
+
+inline registry& global() {
+  static registry r;
+  return r;
+}
+
+inline double now() {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() -
+						   global().epoch).count();
+}
+
+inline threadData& local() {
+  thread_local threadData* t = [] {
+    registry& g = global();
+    std::lock_guard<std::mutex> guard(g.lock);
+    g.threads.push_back(std::make_unique<threadData>());
+    g.threads.back()->tid = g.threads.size();
+    return g.threads.back().get();
+  }();
+  return *t;
+}
+
+// Work done by one thread inside a parallel region. Only the outermost
+// scope on a thread is timed, so recursive passes are not counted twice,
+// and back to back scopes of the same region are merged into one trace
+// event instead of one per particle.
+class scope {
+public:
+  scope(const char* name) : name(name), t(local()) {
+    if (t.depth++ == 0)
+      begin = now();
+  }
+  ~scope() {
+    if (--t.depth != 0)
+      return;
+    double end = now();
+    t.addBusy(name, end - begin);
+    if (!global().tracing)
+      return;
+    if (!t.events.empty() && t.events.back().name == name &&
+	begin - t.events.back().end < 2.0)
+      t.events.back().end = end;
+    else
+      t.events.push_back(traceEvent{ name, begin, end });
+  }
+
+private:
+  const char* name;
+  threadData& t;
+  double begin = 0;
+};
+
+inline void mark(const std::string& name) {
+  registry& g = global();
+  double t = now();
+  std::lock_guard<std::mutex> guard(g.lock);
+  if (g.tracing)
+    g.phases.push_back(phaseEvent{ name, g.lastMark, t });
+  g.lastMark = t;
+}
+
+template<typename Mutex>
+inline void lock(Mutex& m) {
+  local().counters[INSERT_LOCKS]++;
+  if (!m.try_lock()) {
+    local().counters[INSERT_LOCK_WAITS]++;
+    m.lock();
+  }
+}
+
+// Clear everything and restart the clock. Call between iterations, while
+// no parallel region is running.
+inline void beginIteration(bool trace) {
+  registry& g = global();
+  std::lock_guard<std::mutex> guard(g.lock);
+  for (auto& t : g.threads) {
+    for (auto& c : t->counters)
+      c = 0;
+    t->busy.clear();
+    t->events.clear();
+  }
+  g.phases.clear();
+  g.tracing = trace;
+  g.epoch = std::chrono::steady_clock::now();
+  g.lastMark = 0;
+}
+
+inline uint64_t total(counter_e c) {
+  registry& g = global();
+  std::lock_guard<std::mutex> guard(g.lock);
+  uint64_t sum = 0;
+  for (auto& t : g.threads)
+    sum += t->counters[c];
+  return sum;
+}
+
+inline void report(std::ostream& out, size_t particles) {
+  out << "counters";
+  for (int c = 0; c < NUM_COUNTERS; ++c)
+    out << " " << counterName(c) << " " << total(counter_e(c));
+  if (particles) {
+    out << " cellsPerParticle " << double(total(CELL_INTERACTIONS)) / particles
+	<< " particlesPerParticle " << double(total(PARTICLE_INTERACTIONS)) / particles;
+  }
+  out << std::endl;
+
+  registry& g = global();
+  std::lock_guard<std::mutex> guard(g.lock);
+  for (auto& t : g.threads) {
+    if (t->busy.empty())
+      continue;
+    out << "thread " << t->tid << " busy";
+    for (auto& b : t->busy)
+      out << " " << b.first << " " << b.second / 1000 << "ms";
+    out << std::endl;
+  }
+}
+
+inline bool writeTrace(const std::string& path) {
+  std::ofstream out(path);
+  if (!out) {
+    std::cerr << "instrument: cannot write " << path << std::endl;
+    return false;
+  }
+  registry& g = global();
+  std::lock_guard<std::mutex> guard(g.lock);
+  bool first = true;
+  auto event = [&](const std::string& name, double begin, double end, int tid) {
+    out << (first ? "\n" : ",\n")
+	<< "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+	<< ",\"ts\":" << begin << ",\"dur\":" << end - begin << "}";
+    first = false;
+  };
+  // Phases go on their own row, tid 0, above the worker threads.
+  out << "{\"traceEvents\":[";
+  for (auto& e : g.phases)
+    event(e.name, e.begin, e.end, 0);
+  for (auto& t : g.threads)
+    for (auto& e : t->events)
+      event(e.name, e.begin, e.end, t->tid);
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  return bool(out);
+}
+
+} // namespace instrument
+
+#define INSTR_CAT2(a, b) a##b
+#define INSTR_CAT(a, b) INSTR_CAT2(a, b)
+#define INSTR_COUNT(c, n) (instrument::local().counters[instrument::c] += (n))
+#define INSTR_SCOPE(name) instrument::scope INSTR_CAT(instrScope, __LINE__)(name)
+#define INSTR_LOCK(m) instrument::lock(m)
+
+#else
+
+namespace instrument {
+
+const bool enabled = false;
+
+inline void beginIteration(bool) { }
+inline void mark(const std::string&) { }
+inline uint64_t total(counter_e) { return 0; }
+inline void report(std::ostream&, size_t) { }
+inline bool writeTrace(const std::string&) { return false; }
+
+} // namespace instrument
+
+#define INSTR_COUNT(c, n) ((void)sizeof(n))
+#define INSTR_SCOPE(name) ((void)0)
+#define INSTR_LOCK(m) (m).lock()
+
+#endif // OCTTREE_INSTRUMENT
@@ -0,0 +1,58 @@
+#include "octTree.h"
+#include "initialConditions.h"
+
+// Compares every leaf kernel this CPU can run, including the one
+// leafKernel() dispatches to, against the scalar force() law over windows
+// of the initial conditions. The widths cover the vector tails as well as
+// whole vectors. Fails if any kernel is off by more than the tolerance.
+// Run by ctest.
+
+int main() {
+  const size_t numNodes = 20000;
+  const double tolerance = 1e-5; // max |f_kernel - f_ref| / |f_ref|
+  const uint32_t widths[] = { 1, 2, 7, 8, 9, 15, 16, 17, 31, 64, 100 };
+
+  vector<Node> nodes(numNodes);
+  initialConditions(nodes, CLUSTERS, 1);
+  Particles p;
+  p.fromNodes(nodes);
+  otNode ref;
+
+  vector<leafKernel_t> kernels = { leafForceScalar };
+#ifdef LEAF_KERNEL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    kernels.push_back(leafForceAVX2);
+  if (__builtin_cpu_supports("avx512f"))
+    kernels.push_back(leafForceAVX512);
+#endif
+  cout << "dispatch picks " << leafKernelName(leafKernel()) << endl;
+  bool ok = std::find(kernels.begin(), kernels.end(), leafKernel()) != kernels.end();
+
+  uint32_t samples = 1000;
+  for (auto k : kernels) {
+    double maxErr = 0;
+    for (uint32_t width : widths) {
+      for (uint32_t s = 0; s < samples; ++s) {
+	uint32_t n = uint64_t(s) * p.size() / samples;
+	uint32_t first = min<size_t>(n, p.size() - width);
+	glm::dvec3 expect(0);
+	for (uint32_t j = first; j < first + width; ++j) {
+	  if (j == n) continue;
+	  expect += glm::dvec3(ref.force(p.position(n), p.weight[n], p.position(j), p.weight[j]));
+	}
+	glm::dvec3 got(k(p.x.data(), p.y.data(), p.z.data(), p.weight.data(),
+			 first, first + width, n));
+	if (glm::length(expect) > 0)
+	  maxErr = max(maxErr, glm::length(got - expect) / glm::length(expect));
+	else if (glm::length(got) > 0)
+	  maxErr = max(maxErr, 1.0);
+      }
+    }
+    cout << "kernel " << leafKernelName(k) << " maxRelErr " << maxErr
+	 << (maxErr <= tolerance ? " ok" : " FAIL") << endl;
+    ok = ok && maxErr <= tolerance;
+  }
+  cout << (ok ? "ok" : "FAIL") << endl;
+  return ok ? 0 : 1;
+}
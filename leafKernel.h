@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LEAF_KERNEL_X86
+#endif
+
+// Particle-particle kernels for the leaf branch of calcForce. Each one
+// sums the force on particle n from the particles [first, end) of an SoA
+// set, skipping n itself, using the same law as otNode::force():
+//
+//   f = m1 * m2 / (d^2 + sqrt(m1 + m2)) along (p2 - p1) / d
+//
+// Folding the normalisation into the magnitude leaves two square roots and
+// one divide per pair, all in single precision.
+
+typedef glm::vec3 (*leafKernel_t)(const float* x, const float* y, const float* z,
+				  const float* w, uint32_t first, uint32_t end, uint32_t n);
+
+inline glm::vec3 leafForceScalar(const float* x, const float* y, const float* z,
+				 const float* w, uint32_t first, uint32_t end, uint32_t n) {
+  glm::vec3 f(0);
+  for (uint32_t j = first; j < end; ++j) {
+    if (j == n) continue;
+    float dx = x[j] - x[n];
+    float dy = y[j] - y[n];
+    float dz = z[j] - z[n];
+    float r2 = dx * dx + dy * dy + dz * dz;
+    float s = (w[n] * w[j]) / ((r2 + std::sqrt(w[n] + w[j])) * std::sqrt(r2));
+    f += glm::vec3(dx, dy, dz) * s;
+  }
+  return f;
+}
+
+#ifdef LEAF_KERNEL_X86
+
+__attribute__((target("avx2,fma")))
+inline glm::vec3 leafForceAVX2(const float* x, const float* y, const float* z,
+			       const float* w, uint32_t first, uint32_t end, uint32_t n) {
+  const __m256 px = _mm256_set1_ps(x[n]);
+  const __m256 py = _mm256_set1_ps(y[n]);
+  const __m256 pz = _mm256_set1_ps(z[n]);
+  const __m256 m1 = _mm256_set1_ps(w[n]);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i last = _mm256_set1_epi32(end);
+  const __m256i self = _mm256_set1_epi32(n);
+  __m256 fx = _mm256_setzero_ps();
+  __m256 fy = _mm256_setzero_ps();
+  __m256 fz = _mm256_setzero_ps();
+
+  for (uint32_t j = first; j < end; j += 8) {
+    // Lanes past the end of the leaf and the target itself are masked off.
+    __m256i idx = _mm256_add_epi32(_mm256_set1_epi32(j), lanes);
+    __m256i valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(idx, self),
+					_mm256_cmpgt_epi32(last, idx));
+    __m256 dx = _mm256_sub_ps(_mm256_maskload_ps(x + j, valid), px);
+    __m256 dy = _mm256_sub_ps(_mm256_maskload_ps(y + j, valid), py);
+    __m256 dz = _mm256_sub_ps(_mm256_maskload_ps(z + j, valid), pz);
+    __m256 m2 = _mm256_maskload_ps(w + j, valid);
+
+    __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+    __m256 soft = _mm256_sqrt_ps(_mm256_add_ps(m1, m2));
+    __m256 denom = _mm256_mul_ps(_mm256_add_ps(r2, soft), _mm256_sqrt_ps(r2));
+    __m256 s = _mm256_div_ps(_mm256_mul_ps(m1, m2), denom);
+    s = _mm256_and_ps(s, _mm256_castsi256_ps(valid));
+
+    fx = _mm256_fmadd_ps(dx, s, fx);
+    fy = _mm256_fmadd_ps(dy, s, fy);
+    fz = _mm256_fmadd_ps(dz, s, fz);
+  }
+
+  float ox[8], oy[8], oz[8];
+  _mm256_storeu_ps(ox, fx);
+  _mm256_storeu_ps(oy, fy);
+  _mm256_storeu_ps(oz, fz);
+  glm::vec3 f(0);
+  for (int i = 0; i < 8; ++i)
+    f += glm::vec3(ox[i], oy[i], oz[i]);
+  return f;
+}
+
+__attribute__((target("avx512f")))
+inline glm::vec3 leafForceAVX512(const float* x, const float* y, const float* z,
+				 const float* w, uint32_t first, uint32_t end, uint32_t n) {
+  const __m512 px = _mm512_set1_ps(x[n]);
+  const __m512 py = _mm512_set1_ps(y[n]);
+  const __m512 pz = _mm512_set1_ps(z[n]);
+  const __m512 m1 = _mm512_set1_ps(w[n]);
+  __m512 fx = _mm512_setzero_ps();
+  __m512 fy = _mm512_setzero_ps();
+  __m512 fz = _mm512_setzero_ps();
+
+  for (uint32_t j = first; j < end; j += 16) {
+    uint32_t remain = end - j;
+    __mmask16 valid = remain >= 16 ? __mmask16(0xffff) : __mmask16((1u << remain) - 1);
+    if (n >= j && n < j + 16)
+      valid &= __mmask16(~(1u << (n - j)));
+    __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, x + j), px);
+    __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, y + j), py);
+    __m512 dz = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, z + j), pz);
+    __m512 m2 = _mm512_maskz_loadu_ps(valid, w + j);
+
+    __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+    __m512 soft = _mm512_maskz_sqrt_ps(valid, _mm512_add_ps(m1, m2));
+    __m512 denom = _mm512_mul_ps(_mm512_add_ps(r2, soft), _mm512_maskz_sqrt_ps(valid, r2));
+    __m512 s = _mm512_maskz_div_ps(valid, _mm512_mul_ps(m1, m2), denom);
+
+    fx = _mm512_fmadd_ps(dx, s, fx);
+    fy = _mm512_fmadd_ps(dy, s, fy);
+    fz = _mm512_fmadd_ps(dz, s, fz);
+  }
+
+  float ox[16], oy[16], oz[16];
+  _mm512_storeu_ps(ox, fx);
+  _mm512_storeu_ps(oy, fy);
+  _mm512_storeu_ps(oz, fz);
+  glm::vec3 f(0);
+  for (int i = 0; i < 16; ++i)
+    f += glm::vec3(ox[i], oy[i], oz[i]);
+  return f;
+}
+
+#endif // LEAF_KERNEL_X86
+
+inline const char* leafKernelName(leafKernel_t k) {
+#ifdef LEAF_KERNEL_X86
+  if (k == leafForceAVX512)
+    return "avx512";
+  if (k == leafForceAVX2)
+    return "avx2";
+#endif
+  return "scalar";
+}
+
+// Widest kernel the CPU we are running on supports, picked once.
+inline leafKernel_t leafKernel() {
+  static leafKernel_t k = [] {
+#ifdef LEAF_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+      return leafKernel_t(leafForceAVX512);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return leafKernel_t(leafForceAVX2);
+#endif
+    return leafKernel_t(leafForceScalar);
+  }();
+  return k;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "octTree.h"
+
+// Kick-drift-kick leapfrog with power-of-two block timesteps.
+//
+// Every particle sits on a rung k and is integrated with step dt / 2^k.
+// One call to step() advances the whole system by dt in 2^maxRung
+// substeps. All particles drift every substep so the tree is always built
+// from synchronised positions, but only the particles whose own step ends
+// on a substep get a force evaluation and a kick. Rungs come from the
+// usual criterion dt_i = eta * sqrt(softening / |a_i|) and a particle may
+// only move to a longer step where that step would start on the block
+// grid.
+class leapfrog {
+public:
+  float dt;
+  int maxRung;
+  float eta = 0.2f;
+  float softening = 1.0f;
+  size_t forceEvaluations = 0;
+
+  vector<glm::vec3> acc;
+  vector<uint8_t> rung;
+
+  leapfrog(float dt, int maxRung, int threshold, float theta)
+    : dt(dt), maxRung(maxRung), threshold(threshold), theta(theta),
+      root(threshold, &pool)
+  { }
+
+  // Compute the starting accelerations and rungs.
+  void init(nodeArray nodes) {
+    acc.assign(nodes.size(), glm::vec3(0));
+    rung.assign(nodes.size(), 0);
+    active.resize(nodes.size());
+    std::iota(active.begin(), active.end(), 0);
+    buildTree(nodes);
+    accelerations(nodes);
+    for (auto i : active)
+      rung[i] = pickRung(i, 0);
+  }
+
+  void step(nodeArray nodes) {
+    const int substeps = 1 << maxRung;
+    const float dtSub = dt / substeps;
+
+    for (int s = 0; s < substeps; ++s) {
+      // Opening half kick for everyone whose step starts here.
+      std::for_each(std::execution::par_unseq, nodes.begin(), nodes.end(),
+		    [&](Node& n) {
+		      size_t i = &n - nodes.data();
+		      if (s % stride(rung[i]) == 0)
+			n.velocity += acc[i] * (stepOf(rung[i]) / 2.0f);
+		      n.position += n.velocity * dtSub;
+		    });
+
+      // Closing half kick for everyone whose step ends after this drift.
+      active.clear();
+      for (uint32_t i = 0; i < nodes.size(); ++i) {
+	if ((s + 1) % stride(rung[i]) == 0)
+	  active.push_back(i);
+      }
+      buildTree(nodes);
+      accelerations(nodes);
+      std::for_each(std::execution::par_unseq, active.begin(), active.end(),
+		    [&](uint32_t i) {
+		      nodes[i].velocity += acc[i] * (stepOf(rung[i]) / 2.0f);
+		      rung[i] = pickRung(i, s + 1);
+		    });
+    }
+  }
+
+  // Particles on each rung, for reporting.
+  vector<size_t> rungCounts() const {
+    vector<size_t> counts(maxRung + 1, 0);
+    for (auto r : rung)
+      counts[r]++;
+    return counts;
+  }
+
+private:
+  int threshold;
+  float theta;
+  otPool pool;
+  otNode root;
+  vector<uint32_t> active;
+
+  int stride(int r) const { return 1 << (maxRung - r); }
+  float stepOf(int r) const { return dt / float(1 << r); }
+
+  void buildTree(nodeArray nodes) {
+    pool.reset();
+    root.reset(threshold);
+    root.insertSorted(nodes);
+    root.updateStats(true);
+  }
+
+  void accelerations(nodeArray nodes) {
+    std::for_each(std::execution::par_unseq, active.begin(), active.end(),
+		  [&](uint32_t i) {
+		    acc[i] = root.calcForce(&nodes[i], theta) / nodes[i].weight;
+		  });
+    forceEvaluations += active.size();
+  }
+
+  // Rung for particle i at substep s. Shorter steps are always allowed;
+  // a longer step has to line up with the block boundaries.
+  uint8_t pickRung(uint32_t i, int s) const {
+    float a = glm::length(acc[i]);
+    int r = 0;
+    if (a > 0) {
+      float want = eta * std::sqrt(softening / a);
+      r = int(std::ceil(std::log2(dt / want)));
+    }
+    r = std::clamp(r, 0, maxRung);
+    while (r < rung[i] && s % stride(r) != 0)
+      ++r;
+    return r;
+  }
+};
@@ -5,10 +5,13 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <mutex>
 #include <memory>
 #include <chrono>
+#include <execution>
+#include <algorithm>
 using namespace std::chrono;
 using namespace std;
 
@@ -22,6 +25,8 @@ using namespace std;
 #include <glm/gtx/fast_exponential.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "counterRng.h"
+
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
@@ -168,7 +173,7 @@ public:
         else {
             for (auto c : nodes) {
                 if (c == n) continue;
-                f = force(n->position, n->weight, c->position, c->weight);
+                f += force(n->position, n->weight, c->position, c->weight);
             }
         }
         return f;
@@ -303,13 +308,21 @@ int main(int argc, char* argv[]) {
     float theta = 0.7;
     vector<Node> nodes(numNodes);
 
-    // Initialize positions in a ball.
+    // Initialize positions in a ball, the same for the same seed. -S picks
+    // the seed, as in newbench.
+    uint64_t seed = 0;
+    for (int cnt = 1; cnt + 1 < argc; cnt++)
+    {
+        if (strcmp(argv[cnt], "-S") == 0)
+            seed = strtoull(argv[cnt + 1], nullptr, 0);
+    }
     float r = 40 * std::cbrt(numNodes);
-    for (auto& n : nodes) {
-        n.position = glm::ballRand(r);
-        n.weight = glm::fastExp(glm::linearRand(0.0, 6.0));
+    std::for_each(std::execution::par_unseq, nodes.begin(), nodes.end(), [&](Node& n) {
+        counterRng rng(seed, &n - nodes.data());
+        n.position = rng.inBall(r);
+        n.weight = glm::fastExp(rng.uniform(0.0f, 6.0f));
         n.velocity = glm::vec3(0.0f);
-    }
+    });
 
     unsigned int VBO;
     glGenBuffers(1, &VBO);
@@ -399,6 +412,7 @@ int main(int argc, char* argv[]) {
             << duration_cast<microseconds>(high_resolution_clock::now() - start).count() / 1000000.0
             << std::endl;
         start = high_resolution_clock::now();
+        // The tree can't be walked until updateStats() has settled it.
         for (auto& n : nodes) {
             root.insert(&n);
         }
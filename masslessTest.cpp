@@ -0,0 +1,68 @@
+#include "octTree.h"
+#include "counterRng.h"
+
+// Builds a tree where a whole half of the particles are massless, as
+// tracers passed through particleTreeBuild() would be, and fails if any
+// cell ends up with a non-finite baryCenter, if the group walk opens the
+// massless cells down to their particles, or if a force is not finite.
+// Run by ctest.
+
+bool finiteCells(const otNode* c) {
+  const glm::vec3& b = c->baryCenter;
+  if (!std::isfinite(b.x) || !std::isfinite(b.y) || !std::isfinite(b.z))
+    return false;
+  for (auto child : c->children)
+    if (!finiteCells(child))
+      return false;
+  return true;
+}
+
+int main() {
+  const size_t numNodes = 200000;
+  const int threshold = 16;
+  const float theta = 0.7;
+
+  // Two touching balls, the one at negative x massless.
+  vector<glm::vec3> pos(numNodes);
+  for (size_t i = 0; i < numNodes; ++i) {
+    counterRng rng(1, i);
+    pos[i] = rng.inBall(100) + glm::vec3(i % 2 ? 100 : -100, 0, 0);
+  }
+  auto massOf = [&](size_t i) { return i % 2 ? 1.0f : 0.0f; };
+
+  otPool pool;
+  otNode root(threshold, &pool);
+  Particles p;
+  root.insertSorted(p, numNodes, [&](size_t i) { return pos[i]; }, massOf);
+  root.updateStats(true, &p, 2);
+
+  bool ok = finiteCells(&root);
+  cout << "root baryCenter " << root.baryCenter.x << " " << root.baryCenter.y
+       << " " << root.baryCenter.z << endl;
+
+  // A NaN baryCenter fails every opening test, which turns the walk
+  // into a direct sum over all the particles.
+  vector<otNode*> leaves;
+  root.collectLeaves(leaves);
+  otNode::interactionList list;
+  size_t direct = 0;
+  for (auto leaf : leaves) {
+    list.cells.clear();
+    list.ranges.clear();
+    root.interactions(leaf->bbox, theta, list);
+    for (auto& r : list.ranges)
+      direct += r.second - r.first;
+  }
+  float perLeaf = float(direct) / leaves.size();
+  cout << "leaves " << leaves.size() << " particles per interaction list " << perLeaf << endl;
+  if (perLeaf > numNodes / 20)
+    ok = false;
+
+  root.calcForcesGrouped(p, theta);
+  for (size_t i = 0; i < p.size(); ++i)
+    if (!std::isfinite(p.vx[i]) || !std::isfinite(p.vy[i]) || !std::isfinite(p.vz[i]))
+      ok = false;
+
+  cout << (ok ? "ok" : "FAIL") << endl;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+#include <chrono>
+#include <cstring>
+using namespace std::chrono;
+
+#include "octTree.h"
+#include "initialConditions.h"
+#include "directForce.h"
+#include "distributed.h"
+
+// The newbench iteration across MPI ranks, see distributed.h. Run it with
+// e.g. mpirun -np 4 ./mpibench -n 100000. Phase times are the slowest
+// rank's. With -a the first force pass is checked against direct
+// summation over the gathered particles on rank 0, and with -x the run
+// fails if the rms error is above that tolerance. ctest runs it this way.
+
+int run(int argc, char* argv[]) {
+    domain dom;
+
+    unsigned int numNodes = 100;
+    unsigned int threshold = 8;
+    float theta = 0.7;
+    unsigned int iterations = 10;
+    distribution_e distribution = DISK;
+    size_t samples = 0;
+    double tolerance = 0;
+    uint64_t seed = 0;
+    int status = 0;
+
+    for (int cnt = 1; cnt + 1 < argc; cnt++)
+    {
+        if (strcmp(argv[cnt], "-n") == 0)
+            numNodes = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-t") == 0)
+            threshold = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-e") == 0)
+            theta = atof(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-i") == 0)
+            iterations = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-D") == 0 && !parseDistribution(argv[cnt + 1], distribution)) {
+            if (dom.rank == 0)
+                cerr << "unknown distribution " << argv[cnt + 1] << endl;
+            return 1;
+        }
+        if (strcmp(argv[cnt], "-a") == 0)
+            samples = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-x") == 0)
+            tolerance = atof(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-S") == 0)
+            seed = strtoull(argv[cnt + 1], nullptr, 0);
+    }
+
+    if (dom.rank == 0)
+        std::cout << "nodes: " << numNodes << " threshold: " << threshold
+            << " theta: " << theta << " iterations: " << iterations
+            << " distribution: " << distributionName(distribution)
+            << " seed: " << seed
+            << " ranks: " << dom.size
+            << std::endl;
+
+    // Every rank draws its own slice of the initial conditions, which are
+    // the same whatever the number of ranks. Rank 0 also draws all of them
+    // for the accuracy check.
+    size_t first = (uint64_t(dom.rank) * numNodes + dom.size - 1) / dom.size;
+    size_t last = (uint64_t(dom.rank + 1) * numNodes + dom.size - 1) / dom.size;
+    vector<Node> local(last - first);
+    initialConditions(local, distribution, seed, first, numNodes);
+    vector<Node> initial;
+    if (dom.rank == 0 && samples) {
+        initial.resize(numNodes);
+        initialConditions(initial, distribution, seed);
+    }
+
+    auto start = high_resolution_clock::now();
+    auto phase = [&](const char* msg) {
+        double t = duration<double>(high_resolution_clock::now() - start).count();
+        t = dom.maxOver(t);
+        if (dom.rank == 0)
+            cout << " " << msg << " " << t << endl;
+        start = high_resolution_clock::now();
+    };
+
+    otPool pool;
+    otNode root(threshold, &pool);
+    auto iter_start = high_resolution_clock::now();
+    for (unsigned int i = 0; i < iterations; ++i) {
+      start = high_resolution_clock::now();
+      dom.balance(local);
+      phase("balance");
+
+      pool.reset();
+      root.reset(threshold);
+      root.insertSorted(local);
+      root.updateStats(true);
+      phase("local tree");
+
+      vector<Node> all = dom.exchange(root, local, theta);
+      phase("exchange");
+      size_t ghosts = dom.sumOver(all.size() - local.size());
+      size_t cells = dom.sumOver(dom.sentCells);
+      if (dom.rank == 0)
+	cout << " ghosts " << ghosts << " cells " << cells
+	     << " particles " << ghosts - cells << endl;
+
+      pool.reset();
+      root.reset(threshold);
+      root.insertSorted(all);
+      phase("insert");
+
+      root.updateStats(true);
+      phase("stats");
+
+      nodeArray mine(all.data(), local.size());
+      root.calcForces(mine, theta);
+      phase("forces");
+
+      // The particles start at rest, so after the first pass each
+      // velocity is the force on that particle.
+      if (i == 0 && samples) {
+	vector<Node> forces = dom.gather(vector<Node>(mine.begin(), mine.end()));
+	if (dom.rank == 0) {
+	  vector<uint32_t> sample = sampleIndices(initial.size(), samples);
+	  vector<glm::vec3> reference = directForces(initial, sample);
+	  vector<glm::vec3> tree;
+	  for (auto s : sample)
+	    tree.push_back(forces[s].velocity);
+	  forceError e = compareForces(reference, tree);
+	  cout << " accuracy samples " << e.samples
+	       << " rms " << e.rms << " max " << e.max << endl;
+	  if (tolerance > 0 && !(e.rms <= tolerance)) {
+	    cerr << "rms force error above " << tolerance << endl;
+	    status = 1;
+	  }
+	}
+	start = high_resolution_clock::now();
+      }
+
+      root.updatePositions(mine);
+      std::copy(mine.begin(), mine.end(), local.begin());
+      phase("update");
+    }
+    double total = dom.maxOver(duration<double>(high_resolution_clock::now() -
+						iter_start).count());
+    if (dom.rank == 0)
+        cout << " iterations " << total << endl;
+
+    if (dom.sumOver(local.size()) != numNodes) {
+        if (dom.rank == 0)
+            cerr << "lost particles" << endl;
+        return 1;
+    }
+    return status;
+}
+
+int main(int argc, char* argv[]) {
+    MPI_Init(&argc, &argv);
+    int status = run(argc, argv);
+    MPI_Finalize();
+    return status;
+}
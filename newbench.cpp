@@ -1,7 +1,12 @@
 #include <chrono>
+#include <cstring>
 using namespace std::chrono;
 
 #include "octTree.h"
+#include "initialConditions.h"
+#include "leapfrog.h"
+#include "snapshot.h"
+#include "compactTree.h"
 
 high_resolution_clock::time_point
 printTimer(high_resolution_clock::time_point start, std::string msg) {
@@ -9,15 +14,39 @@ printTimer(high_resolution_clock::time_point start, std::string msg) {
        << duration_cast<microseconds>(high_resolution_clock::now() -
 				      start).count() / 1000000.0
        << endl;
+  instrument::mark(msg);
   return high_resolution_clock::now();
 }
 
 int main(int argc, char* argv[]) {
     unsigned int numNodes = 100;
+    distribution_e distribution = DISK;
+    uint64_t seed = 0;
     unsigned int threshold = 8;
     float theta = 0.7;
     unsigned int iterations = 60;
     bool printTree = false;
+    bool sortedBuild = false;
+    bool topDown = false;
+    bool useArena = false;
+    bool useSoA = false;
+    bool groupWalk = false;
+    float listMargin = 0;
+    bool compactWalk = false;
+    int order = 1;
+    float refitMoved = -1;
+    int refitDepth = 32;
+    float leapfrogDt = 0;
+    int maxRung = 4;
+    string snapshotPath;
+    unsigned int snapshotEvery = 0;
+    int snapshotLevel = 0;
+    unsigned int snapshotDepth = 2;
+    string restartPath;
+    string tracePath;
+    unsigned int reorderEvery = 0;
+    unsigned int neighbours = 0;
+    float alpha = 0;
 
     for (int cnt = 1; cnt < argc; cnt++)
     {
@@ -25,51 +54,367 @@ int main(int argc, char* argv[]) {
             numNodes = atoi(argv[cnt + 1]);
         if (strcmp(argv[cnt], "-t") == 0)
             threshold = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-D") == 0 && !parseDistribution(argv[cnt + 1], distribution)) {
+            cerr << "unknown distribution " << argv[cnt + 1] << endl;
+            return 1;
+        }
+        if (strcmp(argv[cnt], "-S") == 0)
+            seed = strtoull(argv[cnt + 1], nullptr, 0);
         if (strcmp(argv[cnt], "-e") == 0)
             theta = atof(argv[cnt + 1]);
         if (strcmp(argv[cnt], "-i") == 0)
             iterations = atoi(argv[cnt + 1]);
         if (strcmp(argv[cnt], "-p") == 0)
             printTree = true;
+        if (strcmp(argv[cnt], "-m") == 0)
+            sortedBuild = true;
+        if (strcmp(argv[cnt], "-u") == 0)
+            topDown = true;
+        if (strcmp(argv[cnt], "-a") == 0)
+            useArena = true;
+        if (strcmp(argv[cnt], "-s") == 0)
+            useSoA = sortedBuild = true;
+        if (strcmp(argv[cnt], "-g") == 0)
+            groupWalk = useSoA = sortedBuild = true;
+        if (strcmp(argv[cnt], "-R") == 0) {
+            listMargin = atof(argv[cnt + 1]);
+            groupWalk = useSoA = sortedBuild = true;
+        }
+        if (strcmp(argv[cnt], "-C") == 0)
+            compactWalk = useSoA = sortedBuild = true;
+        if (strcmp(argv[cnt], "-q") == 0)
+            order = 2;
+        if (strcmp(argv[cnt], "-r") == 0)
+            refitMoved = atof(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-d") == 0)
+            refitDepth = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-l") == 0)
+            leapfrogDt = atof(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-b") == 0)
+            maxRung = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-o") == 0)
+            snapshotPath = argv[cnt + 1];
+        if (strcmp(argv[cnt], "-w") == 0)
+            snapshotEvery = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-Z") == 0)
+            snapshotLevel = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-Q") == 0)
+            snapshotDepth = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-c") == 0)
+            restartPath = argv[cnt + 1];
+        if (strcmp(argv[cnt], "-z") == 0)
+            reorderEvery = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-T") == 0)
+            tracePath = argv[cnt + 1];
+        if (strcmp(argv[cnt], "-N") == 0)
+            neighbours = atoi(argv[cnt + 1]);
+        if (strcmp(argv[cnt], "-A") == 0)
+            alpha = atof(argv[cnt + 1]);
+    }
+    if (refitMoved >= 0 && useSoA) {
+        cout << "refit needs the vector<Node> tree, ignoring -r" << endl;
+        refitMoved = -1;
+    }
+    if (reorderEvery && useSoA) {
+        cout << "SoA storage is always in Morton order, ignoring -z" << endl;
+        reorderEvery = 0;
+    }
+    if (compactWalk && groupWalk) {
+        cout << "the group walk has no compact form, ignoring -C" << endl;
+        compactWalk = false;
+    }
+    if (alpha > 0 && (groupWalk || leapfrogDt > 0)) {
+        cout << "the relative opening criterion needs the per particle walk, ignoring -A" << endl;
+        alpha = 0;
+    }
+    if (!tracePath.empty() && !instrument::enabled) {
+        cout << "built without OCTTREE_INSTRUMENT, ignoring -T" << endl;
+        tracePath.clear();
+    }
+
+    // With -c the particles are the mapped snapshot itself, and the run
+    // picks up its parameters and iteration count.
+    vector<Node> storage;
+    snapshotMap restart;
+    nodeArray nodes;
+    uint64_t firstIteration = 0;
+    if (!restartPath.empty()) {
+        auto start = high_resolution_clock::now();
+        if (!restart.open(restartPath))
+            return 1;
+        nodes = restart.nodes();
+        numNodes = nodes.size();
+        threshold = restart.header.threshold;
+        theta = restart.header.theta;
+        firstIteration = restart.header.iteration;
+        printTimer(start, "restart");
     }
 
     std::cout << "nodes: " << numNodes << " threshold: " << threshold
         << " theta: " << theta << " iterations: " << iterations
+        << " build: " << (sortedBuild ? "morton" : topDown ? "topdown" : "insert")
+        << " arena: " << useArena
+        << " soa: " << useSoA
+        << " walk: " << (groupWalk ? "group" : compactWalk ? "compact" : "particle")
+        << " margin: " << listMargin
+        << " order: " << order
+        << " opening: " << (alpha > 0 ? "relative " + to_string(alpha) : "geometric")
+        << " neighbours: " << neighbours
+        << " reorder: " << reorderEvery
+        << " refit: " << refitMoved << "/" << refitDepth
+        << " leapfrog: " << leapfrogDt << "/" << maxRung
+        << " iteration: " << firstIteration
+        << " distribution: " << distributionName(distribution)
+        << " seed: " << seed
         << std::endl;
-    vector<Node> nodes(numNodes);
-
-    // Initialize positions in a ball.
-    float r = 40 * std::cbrt(numNodes);
-    for (auto& n : nodes) {
-        //	n.position = glm::ballRand(r);
-        n.position = glm::vec3(glm::diskRand(r), 1.0);
-        n.weight = glm::fastExp(glm::linearRand(0.0, 6.0));
-        n.velocity = glm::vec3(0.0f);
+
+    if (restartPath.empty()) {
+        auto start = high_resolution_clock::now();
+        storage.resize(numNodes);
+        nodes = storage;
+        initialConditions(nodes, distribution, seed);
+        printTimer(start, "initial");
     }
 
+    // -o writes a snapshot at the end of the run and, with -w, every that
+    // many iterations. They are written in the background, compressed at
+    // zlib level -Z, with at most -Q of them in flight; the timer only
+    // covers the copy, and any wait for the writer.
+    snapshotWriter writer(snapshotDepth, snapshotLevel);
+    auto checkpoint = [&](uint64_t iteration) {
+        auto start = high_resolution_clock::now();
+        snapshotHeader h;
+        h.iteration = iteration;
+        h.threshold = threshold;
+        h.theta = theta;
+        writer.write(snapshotPath, nodes, h);
+        printTimer(start, "snapshot");
+    };
+    auto finishSnapshots = [&]() {
+        if (snapshotPath.empty())
+            return true;
+        auto start = high_resolution_clock::now();
+        writer.flush();
+        printTimer(start, "snapshot flush");
+        cout << " snapshots " << writer.written << " stalls " << writer.stalls << endl;
+        return writer.failed == 0;
+    };
+    auto wantCheckpoint = [&](unsigned int i) {
+        return !snapshotPath.empty() &&
+            (i + 1 == iterations || (snapshotEvery && (i + 1) % snapshotEvery == 0));
+    };
+
+    cout << " leaf kernel " << leafKernelName(leafKernel()) << endl;
+
+    // With -l each iteration is one leapfrog step of that size, split into
+    // up to 2^-b block substeps.
+    if (leapfrogDt > 0) {
+      leapfrog lf(leapfrogDt, maxRung, threshold, theta);
+      lf.init(nodes);
+
+      auto iter_start = high_resolution_clock::now();
+      for (unsigned int i = 0; i < iterations; ++i) {
+	auto start = high_resolution_clock::now();
+	size_t evaluations = lf.forceEvaluations;
+	lf.step(nodes);
+	start = printTimer(start, "step");
+
+	cout << " forceEvaluations " << lf.forceEvaluations - evaluations
+	     << " rungs";
+	for (auto c : lf.rungCounts())
+	  cout << " " << c;
+	cout << endl;
+
+	if (wantCheckpoint(i))
+	  checkpoint(firstIteration + i + 1);
+      }
+      printTimer(iter_start, "iterations");
+      return finishSnapshots() ? 0 : 1;
+    }
+
+    // With -s the simulation runs on SoA storage, which is always built
+    // in Morton order.
+    Particles particles;
+    if (useSoA)
+        particles.fromNodes(nodes);
+
+    // With -a the tree is recycled through an arena instead of being
+    // rebuilt from the heap every iteration.
+    otPool pool;
+    otNode pooledRoot(threshold, &pool);
+
+    // With -r the previous iteration's tree is refitted unless more than
+    // that fraction of the particles left their leaf or it is deeper than -d.
+    unique_ptr<otNode> freshRoot;
+    otNode* root = nullptr;
+
+    // With -R the group walk's lists are kept, along with the tree, until
+    // a particle has moved more than a third of that margin.
+    otNode::interactionCache lists(listMargin);
+
+    // With -C the force pass walks a compact copy of the tree.
+    compactTree compact;
+
+    // With -A the cells are opened by the relative error criterion at that
+    // tolerance, using each particle's force from the previous iteration;
+    // the first iteration uses theta.
+    vector<float> lastForce;
+
+    // With -N k the force pass is followed by a search for the k nearest
+    // neighbours of every particle, then one for all particles within the
+    // mean k-th neighbour distance, both on the same tree.
+    vector<glm::vec3> queries;
+    vector<uint32_t> found, foundCounts;
+    vector<float> foundDist2;
+    auto searchNeighbours = [&](const auto& store) {
+	auto start = high_resolution_clock::now();
+	found.resize(queries.size() * neighbours);
+	foundDist2.resize(queries.size() * neighbours);
+	root->knn(store, queries.data(), queries.size(), neighbours,
+		  found.data(), foundDist2.data());
+	double radius = 0;
+	for (size_t q = 0; q < queries.size(); ++q)
+	  radius += std::sqrt(foundDist2[q * neighbours + neighbours - 1]);
+	radius /= max<size_t>(queries.size(), 1);
+	start = printTimer(start, "knn");
+
+	found.resize(queries.size() * 4 * neighbours);
+	foundCounts.resize(queries.size());
+	root->radiusQuery(store, queries.data(), queries.size(), radius, 4 * neighbours,
+			  found.data(), foundCounts.data());
+	start = printTimer(start, "radius");
+	size_t total = std::accumulate(foundCounts.begin(), foundCounts.end(), size_t(0));
+	cout << " radius " << radius << " meanNeighbours "
+	     << double(total) / max<size_t>(queries.size(), 1) << endl;
+    };
+
     auto iter_start = high_resolution_clock::now();
     for (int i = 0; i < iterations; ++i) {
+      instrument::beginIteration(!tracePath.empty());
       auto start = high_resolution_clock::now();
-      otNode root(threshold);
+      size_t allocations = pool.allocations;
+      bool refitted = false;
+      // With -z the particles are put back into Morton order every that
+      // many iterations. The old tree points at the old order, so it is
+      // rebuilt rather than refitted.
+      if (reorderEvery && i % reorderEvery == 0) {
+	pooledRoot.reorder(nodes);
+	root = nullptr;
+	start = printTimer(start, "reorder");
+      }
+      if (listMargin > 0 && root) {
+	refitted = lists.valid(particles);
+	if (!refitted)
+	  lists.invalidate();
+	start = printTimer(start, "displacement");
+      }
+      if (refitMoved >= 0 && root) {
+	otNode::refitStats refit;
+	refitted = root->refit(refitMoved, refitDepth, &refit);
+	cout << " refit moved " << refit.moved << "/" << refit.particles
+	     << " maxDepth " << refit.maxDepth
+	     << (refitted ? "" : " rebuild") << endl;
+	start = printTimer(start, "refit");
+      }
+      if (!refitted) {
+	if (useArena) {
+	  pool.reset();
+	  pooledRoot.reset(threshold);
+	  root = &pooledRoot;
+	}
+	else {
+	  freshRoot.reset(new otNode(threshold));
+	  root = freshRoot.get();
+	}
+      }
       start = printTimer(start, "root");
 
-      root.insertNodes(nodes);
+      if (!refitted) {
+	if (useSoA)
+	  root->insertSorted(particles);
+	else if (sortedBuild)
+	  root->insertSorted(nodes);
+	else if (topDown)
+	  root->buildTopDown(nodes);
+	else
+	  root->insertNodes(nodes);
+      }
       start = printTimer(start, "insert");
 
-      root.updateStats(true);
+      root->updateStats(true, useSoA ? &particles : nullptr, order);
       start = printTimer(start, "stats");
 
-      root.debug();
+      root->debug();
       if (printTree)
-	root.print();
+	root->print();
+      if (useArena)
+	cout << " allocations " << pool.allocations - allocations
+	     << " blocks " << pool.blocks() << endl;
+
+      if (compactWalk) {
+	start = high_resolution_clock::now();
+	compact.build(*root);
+	start = printTimer(start, "compact");
+	compact.debug(particles.size());
+      }
 
-      root.calcForces(nodes, theta);
+      if (groupWalk && listMargin > 0) {
+	size_t hits = lists.hits;
+	root->calcForcesGrouped(particles, theta, lists);
+	cout << " lists " << (lists.hits > hits ? "reused" : "walked")
+	     << " hitRate " << lists.hitRate() << endl;
+      }
+      else if (groupWalk)
+	root->calcForcesGrouped(particles, theta);
+      else if (compactWalk && alpha > 0)
+	compact.calcForces(particles, alpha, theta, lastForce);
+      else if (compactWalk)
+	compact.calcForces(particles, theta);
+      else if (useSoA && alpha > 0)
+	root->calcForces(particles, alpha, theta, lastForce);
+      else if (useSoA)
+	root->calcForces(particles, theta);
+      else if (alpha > 0)
+	root->calcForces(nodes, alpha, theta, lastForce);
+      else
+	root->calcForces(nodes, theta);
       start = printTimer(start, "forces");
 
-      root.updatePositions(nodes);
+      if (neighbours && useSoA) {
+	queries.resize(particles.size());
+	for (size_t q = 0; q < queries.size(); ++q)
+	  queries[q] = particles.position(q);
+	searchNeighbours(particles);
+	start = high_resolution_clock::now();
+      }
+      else if (neighbours) {
+	queries.resize(nodes.size());
+	for (size_t q = 0; q < queries.size(); ++q)
+	  queries[q] = nodes[q].position;
+	searchNeighbours(nodes);
+	start = high_resolution_clock::now();
+      }
+
+      if (useSoA)
+	root->updatePositions(particles);
+      else
+	root->updatePositions(nodes);
       start = printTimer(start, "update");
+
+      if (wantCheckpoint(i)) {
+	if (useSoA)
+	  particles.toNodes(nodes);
+	checkpoint(firstIteration + i + 1);
+      }
+
+      // With -T each iteration is written to <prefix>.<iteration>.json.
+      instrument::report(cout, nodes.size());
+      if (!tracePath.empty())
+	instrument::writeTrace(tracePath + "." + to_string(firstIteration + i) + ".json");
     }
+    if (useSoA)
+      particles.toNodes(nodes);
     printTimer(iter_start, "iterations");
     
-    return 0;
+    return finishSnapshots() ? 0 : 1;
 }
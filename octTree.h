@@ -1,12 +1,22 @@
+#include <cassert>
 #include <cstdlib>
 #include <iostream>
 #include <mutex>
+#include <atomic>
 #include <memory>
 #include <chrono>
 #include <execution>
 #include <algorithm>
 #include <thread>
+#include <array>
 #include <vector>
+#include <cstdint>
+#include <numeric>
+#include <utility>
+#include <limits>
+#include <type_traits>
+
+#include <tbb/task_group.h>
 
 using namespace std::chrono;
 using namespace std;
@@ -22,6 +32,10 @@ using namespace std;
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/string_cast.hpp>
 
+#include "forceLaw.h"
+#include "leafKernel.h"
+#include "instrument.h"
+
 #pragma once
 
 struct bbox_t {
@@ -30,6 +44,8 @@ struct bbox_t {
   bool unset = true;
 
   bbox_t& operator+=(const bbox_t& b) {
+    if (b.unset)
+      return *this;
     *this += b.min;
     *this += b.max;
     return *this;
@@ -59,19 +75,231 @@ struct Node {
   glm::vec3 position;
   float weight;
   glm::vec3 velocity;
-  float unused;
+  uint32_t id;   // stable across reorder(), for mapping results back
+};
+
+// Non-owning view of a particle array. Everything that walks the
+// particles takes one of these, so the same code runs on a vector<Node>
+// or on memory it does not own, such as a mapped snapshot.
+struct nodeArray {
+  Node* ptr = nullptr;
+  size_t n = 0;
+
+  nodeArray() = default;
+  nodeArray(Node* p, size_t n) : ptr(p), n(n) { }
+  nodeArray(vector<Node>& v) : ptr(v.data()), n(v.size()) { }
+
+  Node* data() const { return ptr; }
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  Node* begin() const { return ptr; }
+  Node* end() const { return ptr + n; }
+  Node& operator[](size_t i) const { return ptr[i]; }
+};
+
+// Morton key and the index of the particle it belongs to.
+typedef pair<uint64_t, uint32_t> mortonKey_t;
+
+// Allocator for cache line aligned arrays.
+template<typename T, size_t Align = 64>
+struct alignedAllocator {
+  typedef T value_type;
+  template<typename U> struct rebind { typedef alignedAllocator<U, Align> other; };
+
+  alignedAllocator() = default;
+  template<typename U>
+  alignedAllocator(const alignedAllocator<U, Align>&) { }
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+  }
+  void deallocate(T* p, size_t) {
+    ::operator delete(p, std::align_val_t(Align));
+  }
+
+  template<typename U>
+  bool operator==(const alignedAllocator<U, Align>&) const { return true; }
+  template<typename U>
+  bool operator!=(const alignedAllocator<U, Align>&) const { return false; }
+};
+
+// Structure of arrays particle storage. The force pass only reads
+// position and weight, so keeping each field in its own array halves the
+// bytes it pulls through the cache compared to walking vector<Node>. id
+// holds each particle's index in the vector<Node> it was loaded from,
+// which survives the reordering done by otNode::insertSorted().
+struct Particles {
+  typedef vector<float, alignedAllocator<float>> array_t;
+  array_t x, y, z, weight;
+  array_t vx, vy, vz;
+  vector<uint32_t> id;
+
+  size_t size() const { return x.size(); }
+
+  void resize(size_t n) {
+    for (auto a : { &x, &y, &z, &weight, &vx, &vy, &vz })
+      a->resize(n);
+    id.resize(n);
+  }
+
+  glm::vec3 position(size_t i) const { return glm::vec3(x[i], y[i], z[i]); }
+  glm::vec3 velocity(size_t i) const { return glm::vec3(vx[i], vy[i], vz[i]); }
+
+  void fromNodes(nodeArray nodes) {
+    resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      const Node& n = nodes[i];
+      x[i] = n.position.x;
+      y[i] = n.position.y;
+      z[i] = n.position.z;
+      weight[i] = n.weight;
+      vx[i] = n.velocity.x;
+      vy[i] = n.velocity.y;
+      vz[i] = n.velocity.z;
+      id[i] = i;
+    }
+  }
+
+  // Interleaved view for upload or printing, in the original order.
+  void toNodes(vector<Node>& nodes) const {
+    nodes.resize(size());
+    toNodes(nodeArray(nodes));
+  }
+  void toNodes(nodeArray nodes) const {
+    for (size_t i = 0; i < size(); ++i) {
+      Node& n = nodes[id[i]];
+      n.position = position(i);
+      n.weight = weight[i];
+      n.velocity = velocity(i);
+    }
+  }
+
+  // Reorder so that particle i becomes keys[i].second.
+  void permute(const vector<mortonKey_t>& keys) {
+    spare.resize(size());
+    for (auto a : { &x, &y, &z, &weight, &vx, &vy, &vz }) {
+      array_t& src = *a;
+      std::for_each(std::execution::par_unseq, keys.begin(), keys.end(),
+		    [&](const mortonKey_t& k) {
+		      spare[&k - keys.data()] = src[k.second];
+		    });
+      src.swap(spare);
+    }
+    spareId.resize(size());
+    std::for_each(std::execution::par_unseq, keys.begin(), keys.end(),
+		  [&](const mortonKey_t& k) {
+		    spareId[&k - keys.data()] = id[k.second];
+		  });
+    id.swap(spareId);
+  }
+
+private:
+  array_t spare;
+  vector<uint32_t> spareId;
 };
 
-class otNode
+// Working storage for the Morton build's radix sort.
+struct sortScratch_t {
+  vector<mortonKey_t> keys;
+  vector<mortonKey_t> tmp;
+  vector<size_t> chunks;
+  vector<array<size_t, 256>> offsets;
+  vector<Node*> pointers;   // partitioned in place by buildTopDown()
+  vector<Node> spareNodes;  // target of reorder()
+
+  // Size everything for n keys, returning how many buffers had to grow.
+  size_t prepare(size_t n, size_t numChunks) {
+    size_t grown = (n > keys.capacity()) + (n > tmp.capacity()) +
+      (numChunks > chunks.capacity()) + (numChunks > offsets.capacity());
+    keys.resize(n);
+    tmp.resize(n);
+    chunks.resize(numChunks);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    offsets.resize(numChunks);
+    return grown;
+  }
+};
+
+template<typename Law = defaultLaw> class otNodeT;
+
+// A split made by the lock-free insert(), see otNodeT.
+template<typename Law>
+struct otSplitT {
+  glm::vec3 center;
+  otNodeT<Law>* children[8];
+};
+
+// Arena for octree cells. Cells are handed out eight at a time, one block
+// per split, and reset() recycles them instead of freeing them. Cells keep
+// their vectors' capacity across resets so a tree rebuilt every timestep
+// stops touching the heap once it has warmed up; allocations counts every
+// heap allocation made on the tree's behalf to show that it did. Each
+// block comes with the otSplitT that publishes it. The slots insert()
+// fills are carved separately, and only for the cells it reaches, so
+// trees built any other way pay nothing for them.
+template<typename Law>
+class otPoolT {
+public:
+  static const size_t firstChunk = 1024; // blocks in chunk 0, doubling after
+  atomic<size_t> allocations{0};
+  sortScratch_t scratch;
+
+  otPoolT() {
+    for (auto& c : chunks)
+      c = nullptr;
+    splits.fill(nullptr);
+    for (auto& c : slotChunks)
+      c = nullptr;
+  }
+  ~otPoolT();
+
+  otNodeT<Law>* allocBlock(int threshold, otSplitT<Law>** split = nullptr);
+  // threshold empty slots, or null if this build's chunk was made for
+  // a smaller threshold.
+  atomic<Node*>* allocSlots(int threshold);
+  void reset() { next = 0; nextSlots = 0; }
+  size_t blocks() const { return next; }
+
+private:
+  atomic<size_t> next{0};
+  std::mutex growLock;
+  array<atomic<otNodeT<Law>*>, 48> chunks;
+  // Set before chunks[k] is published.
+  array<otSplitT<Law>*, 48> splits;
+  // Slots, laid out like the blocks but one group per cell, each chunk
+  // with the group width it was made with.
+  atomic<size_t> nextSlots{0};
+  array<atomic<atomic<Node*>*>, 48> slotChunks;
+  array<int, 48> slotWidth;
+};
+
+// Octree over the particles, with the force law and precision fixed at
+// compile time by Law, see forceLaw.h. otNodeT is the default law.
+template<typename Law>
+class otNodeT
 {
 public:
+  typedef otPoolT<Law> pool_t;
+
   enum type_e { LEAF, NODE };
   type_e type;
 
   int threshold;
   vector<Node*> nodes;
-  vector<otNode*> children;
-  std::mutex lock;
+  vector<otNodeT*> children;
+  std::mutex lock;   // insertLocked() only
+
+  // State of the lock-free insert(). A leaf's new particles go in slots,
+  // a split is published as a splitBlock, and updateStats() folds both
+  // back into nodes, children and center. In an arena the slots and
+  // split blocks belong to the pool, elsewhere to the cell. Slots are
+  // only given to a leaf when insert() first reaches it.
+  typedef otSplitT<Law> splitBlock;
+  atomic<atomic<Node*>*> slots{nullptr};
+  uint32_t slotCapacity = 0;
+  bool ownSlots = false;
+  atomic<uint32_t> reserved{0};
+  atomic<splitBlock*> published{nullptr};
 
   glm::vec3 center;
 
@@ -79,64 +307,231 @@ public:
   bbox_t bbox;
   float bboxSize = 0.0;
   glm::vec3 baryCenter;
+  float bmax = 0;   // distance from baryCenter to the furthest bbox corner
+
+  // Multipole order from the last updateStats(): 1 is monopole only, 2
+  // adds the traceless quadrupole about baryCenter, stored as
+  // xx, yy, zz, xy, xz, yz.
+  int order = 1;
+  float quad[6] = { 0, 0, 0, 0, 0, 0 };
+
+  // Particles [first, first + count) when built by insertSorted().
+  uint32_t first = 0;
+  uint32_t count = 0;
 
- otNode(int t = 4) : threshold(t), center(0), baryCenter(0), type(LEAF)
+  // Set when the cell lives in an arena, which then owns the children.
+  pool_t* pool = nullptr;
+
+ otNodeT(int t = 4, pool_t* p = nullptr) : threshold(t), center(0), baryCenter(0), type(LEAF), pool(p)
     { }
-  ~otNode() {
-    for (auto c : children) {
-      delete c;
+  ~otNodeT() {
+    splitBlock* s = published.load();
+    if (!pool) {
+      for (auto c : children) {
+	delete c;
+      }
+      // A split that updateStats() never adopted.
+      if (s && children.empty())
+	for (auto c : s->children)
+	  delete c;
+      delete s;
+    }
+    if (ownSlots)
+      delete[] slots.load();
+  }
+
+  // Return the cell to an empty leaf, keeping its vectors' storage.
+  void reset(int t) {
+    type = LEAF;
+    // Slots from a pool go back to it; the pool clears them when it
+    // hands them out again.
+    if (!ownSlots || uint32_t(t) > slotCapacity) {
+      if (ownSlots)
+	delete[] slots.load();
+      slots = nullptr;
+      slotCapacity = 0;
+      ownSlots = false;
+    }
+    threshold = t;
+    clearSlots();
+    splitBlock* s = published.exchange(nullptr);
+    if (!pool)
+      delete s;
+    nodes.clear();
+    children.clear();
+    center = glm::vec3(0);
+    weight = 0;
+    bbox = bbox_t();
+    bboxSize = 0.0;
+    baryCenter = glm::vec3(0);
+    bmax = 0;
+    order = 1;
+    std::fill(quad, quad + 6, 0.0f);
+    first = count = 0;
+  }
+
+  // Size a leaf made by insert() once per recycled cell: nodes for a
+  // full leaf, which never holds more than threshold particles, and
+  // children for when particles moving between builds make it split.
+  // Other builds only reserve what a cell turns out to need.
+  void reserveLeaf() {
+    track(nodes, threshold);
+    nodes.reserve(threshold);
+    track(children, 8);
+    children.reserve(8);
+  }
+
+  // Count a heap allocation if v has to grow to hold size elements.
+  template<typename V>
+  void track(const V& v, size_t size) {
+    if (pool && size > v.capacity())
+      pool->allocations++;
+  }
+
+  void split() {
+    otNodeT* block = pool ? pool->allocBlock(threshold) : nullptr;
+    track(children, 8);
+    children.reserve(8);
+    for (int i = 0; i < 8; ++i) {
+      children.push_back(block ? block + i : new otNodeT(threshold));
     }
   }
 
-  void updateStats(bool parallel) {
+  // Particles held by a leaf, whichever way it was built.
+  size_t leafSize() const {
+    return nodes.empty() ? count : nodes.size();
+  }
+
+  // Add mass m at offset d from baryCenter to the quadrupole.
+  void addQuad(const glm::vec3& d, float m) {
+    float r2 = glm::dot(d, d);
+    quad[0] += m * (3 * d.x * d.x - r2);
+    quad[1] += m * (3 * d.y * d.y - r2);
+    quad[2] += m * (3 * d.z * d.z - r2);
+    quad[3] += m * 3 * d.x * d.y;
+    quad[4] += m * 3 * d.x * d.z;
+    quad[5] += m * 3 * d.y * d.z;
+  }
+
+  // Turn the weighted sum in baryCenter into the center of mass. A cell
+  // of massless particles has none; it gets its bbox center, so it stays
+  // finite and an accepted cell just adds nothing.
+  void centerOfMass() {
+    if (weight > 0)
+      baryCenter /= weight;
+    else
+      baryCenter = bbox.unset ? glm::vec3(0) : bbox.center();
+  }
+
+  // Pass the particles when the tree was built from a Particles set.
+  // order 2 also accumulates quadrupole moments in the same pass.
+  // Subtrees below this many particles are updated serially. Trees built
+  // by insert() do not count their particles, so there every internal
+  // cell is a task.
+  static const size_t statsGrain = 2048;
+
+  void updateStats(bool parallel, const Particles* p = nullptr, int order = 1) {
+    settle();
+    this->order = order;
+    // Start from scratch so a refitted tree can be updated again.
+    weight = 0;
+    bbox = bbox_t();
+    baryCenter = glm::vec3(0);
+    std::fill(quad, quad + 6, 0.0f);
     if (type == NODE) {
-      // First update all children
+      for (auto& c : children)
+	c->settle();
+      // First update all children. In parallel every subtree worth a task
+      // gets one, at every level, so a skewed tree still spreads over all
+      // cores. The merge below always runs in child order, so the result
+      // is bit-identical to the serial pass however the work was split.
       if (parallel) {
-	std::for_each(std::execution::par_unseq, children.begin(), children.end(),
-		      [&](auto& c) {
-			c->updateStats(false);
-		      });
+	tbb::task_group tasks;
+	for (auto& c : children) {
+	  if (c->type == NODE && (c->count == 0 || c->count > statsGrain)) {
+	    tasks.run([=] {
+		INSTR_SCOPE("stats");
+		c->updateStats(true, p, order);
+	      });
+	  }
+	  else {
+	    INSTR_SCOPE("stats");
+	    c->updateStats(false, p, order);
+	  }
+	}
+	tasks.wait();
       }
       else {
 	for (auto& c : children) {
-	  c->updateStats(false);
+	  c->updateStats(false, p, order);
 	}
       }
 
       for (auto& c : children) {
-	if (c->type == LEAF && c->nodes.empty())
+	if (c->type == LEAF && c->leafSize() == 0)
 	  continue;
 	bbox += c->bbox;
+	if (c->weight == 0)
+	  continue;
 	weight += c->weight;
 	baryCenter += c->baryCenter * float(c->weight);
       }
-      baryCenter /= weight;
+      centerOfMass();
+      if (order > 1) {
+	// Shift each child's moments to our baryCenter.
+	for (auto& c : children) {
+	  if (c->weight == 0)
+	    continue;
+	  for (int i = 0; i < 6; ++i)
+	    quad[i] += c->quad[i];
+	  addQuad(c->baryCenter - baryCenter, c->weight);
+	}
+      }
       bboxSize = ((bbox.max.x - bbox.min.x) +
 		  (bbox.max.y - bbox.min.y) +
 		  (bbox.max.z - bbox.min.z)) / 3.0;
     }
     else {
       // LEAF
-      if (!nodes.empty())
+      if (p && count) {
+	for (uint32_t i = first; i < first + count; ++i) {
+	  glm::vec3 pos = p->position(i);
+	  bbox += pos;
+	  weight += p->weight[i];
+	  baryCenter += pos * p->weight[i];
+	}
+	centerOfMass();
+	if (order > 1) {
+	  for (uint32_t i = first; i < first + count; ++i)
+	    addQuad(p->position(i) - baryCenter, p->weight[i]);
+	}
+      }
+      else if (!nodes.empty())
 	{
 	  for (auto n : nodes) {
 	    bbox += n->position;
 	    weight += n->weight;
 	    baryCenter += n->position * n->weight;
 	  }
-	  baryCenter /= weight;
+	  centerOfMass();
+	  if (order > 1) {
+	    for (auto n : nodes)
+	      addQuad(n->position - baryCenter, n->weight);
+	  }
 	}
     }
+    if (!bbox.unset)
+      bmax = glm::length(glm::max(bbox.max - baryCenter, baryCenter - bbox.min));
   }
 
   void print(int i = 0, string prefix = "0", bool leafNodes = false) {
 	  if (type == LEAF) {
-		  if (nodes.empty())
+		  if (leafSize() == 0)
 			  return;
 		  for (int c = 0; c < i; ++c) {
 			  cout << " ";
 		  }
-		  cout << prefix << " LEAF " << nodes.size() << " ";
+		  cout << prefix << " LEAF " << leafSize() << " ";
 		  bbox.print();
 		  cout << " BC " << glm::to_string(baryCenter) << " W " << weight
 			  << " size " << bboxSize << endl;
@@ -165,45 +560,291 @@ public:
 	  }
   }
 
+  // Forces are computed and summed in the law's precision.
+  typedef typename Law::accum_t accum_t;
+
   // Function for calculating the accelerate on m1 by m2
-  glm::vec3 force(const glm::vec3& p1, float m1, const glm::vec3& p2, float m2) {
-    double d = glm::distance(p2, p1);
+  static accum_t force(const glm::vec3& p1, float m1, const glm::vec3& p2, float m2) {
+    return Law::force(p1, m1, p2, m2);
+  }
 
-    // m1*m2 / r^2
-    float force = (m1 * m2) / ((d * d) + sqrt(m1 + m2));
+  // Leaf sum for SoA particles. Laws that match the SIMD kernels use
+  // those, the rest get a plain loop over force(). The kernel is picked
+  // once per process, so the call stays a single indirect jump.
+  static accum_t leafForce(const Particles& p, uint32_t first, uint32_t end, uint32_t n) {
+    if constexpr (Law::leafKernels) {
+      return accum_t(leafKernel()(p.x.data(), p.y.data(), p.z.data(), p.weight.data(),
+				  first, end, n));
+    }
+    else {
+      accum_t f(0);
+      glm::vec3 pos = p.position(n);
+      for (uint32_t j = first; j < end; ++j) {
+	if (j == n) continue;
+	f += Law::force(pos, p.weight[n], p.position(j), p.weight[j]);
+      }
+      return f;
+    }
+  }
 
-    glm::vec3 direction = glm::normalize(p2 - p1);
-    return direction * force;
+  // Force on m1 at p1 from this cell as a whole. The quadrupole term is
+  // the unsoftened one; cells are only accepted well outside the
+  // softening length. Both terms are evaluated in the law's precision,
+  // but the moments themselves are stored in float whatever the law.
+  accum_t cellForce(const glm::vec3& p1, float m1) const {
+    return cellForce(p1, m1, baryCenter, weight, quad, order);
+  }
+  static accum_t cellForce(const glm::vec3& p1, float m1, const glm::vec3& baryCenter,
+			   float weight, const float* quad, int order) {
+    accum_t f = force(p1, m1, baryCenter, weight);
+    if (order > 1) {
+      typedef typename Law::T T;
+      accum_t r = accum_t(p1) - accum_t(baryCenter);
+      T inv2 = T(1) / glm::dot(r, r);
+      T inv5 = inv2 * inv2 * std::sqrt(inv2);
+      accum_t qr(T(quad[0]) * r.x + T(quad[3]) * r.y + T(quad[4]) * r.z,
+		 T(quad[3]) * r.x + T(quad[1]) * r.y + T(quad[5]) * r.z,
+		 T(quad[4]) * r.x + T(quad[5]) * r.y + T(quad[2]) * r.z);
+      T rqr = glm::dot(r, qr);
+      f += (qr - r * (T(2.5) * rqr * inv2)) * (T(m1) * inv5);
+    }
+    return f;
   }
 
-  void insertNodes(vector<Node>& nodes) {
+  // With locked the particles go through insertLocked() instead.
+  // Without it, as with insert(), the tree is unusable for anything but
+  // more inserts until updateStats() has run.
+  void insertNodes(nodeArray nodes, bool locked = false) {
     std::for_each(std::execution::par_unseq, nodes.begin(), nodes.end(),
 		  [&](auto& n) {
-		    insert(&n);
+		    INSTR_SCOPE("insert");
+		    if (locked)
+		      insertLocked(&n);
+		    else
+		      insert(&n);
 		  });          
   }
+
+  static int octant(const glm::vec3& p, const glm::vec3& center) {
+    glm::vec3 cmp = glm::greaterThan(p, center);
+    return cmp.x * 2 + cmp.y * 1 + cmp.z * 4;
+  }
+
+  // Lock-free insert, safe from any number of threads at once, also into
+  // a tree from an earlier build or refit. A leaf hands out its free
+  // places with a fetch_add on reserved, and each particle is written
+  // into its slot with a compare and swap from null. The thread that
+  // takes the last place splits the leaf: it seals every slot still
+  // empty, so whoever owns one finds it taken and goes round again, then
+  // builds the eight children and their particles privately and
+  // publishes them with a single compare and swap. Threads arriving at a
+  // full leaf give it a moment and then build the same split themselves.
+  // Nobody ever waits for another thread to finish, so a stalled thread
+  // holds nobody up; the first to publish wins and the others discard
+  // theirs.
+  //
+  // While inserts are running the new particles and splits live only in
+  // slots and published. Nothing but insert() may touch the tree until
+  // settle(), which updateStats() runs on every cell, has folded them
+  // back into nodes, children and center; debug() checks that it has.
+  static const int helpAfter = 64;
+
   void insert(Node* n) {
+    otNodeT* c = this;
+    while (true) {
+      if (c->type == NODE) {
+	c = c->children[octant(n->position, c->center)];
+	continue;
+      }
+      splitBlock* s = c->published.load(memory_order_acquire);
+      if (s) {
+	c = s->children[octant(n->position, s->center)];
+	continue;
+      }
+      if (c->add(n))
+	return;
+    }
+  }
+
+  // Places left in a leaf before it has to split; nodes does not change
+  // while inserts are running.
+  uint32_t room() const {
+    return nodes.size() < size_t(threshold) ? threshold - nodes.size() : 0;
+  }
+
+  // Store n in this leaf, or return false once it is full and split.
+  bool add(Node* n) {
+    atomic<Node*>* s = slotArray();
+    uint32_t free = room();
+    uint32_t k = reserved.fetch_add(1, memory_order_relaxed);
+    if (k < free) {
+      Node* empty = nullptr;
+      if (!s[k].compare_exchange_strong(empty, n, memory_order_acq_rel))
+	return false;   // sealed by a splitter
+      if (k + 1 == free)
+	splitFull(n->position);
+      return true;
+    }
+    if (free == 0 && k == 0) {
+      splitFull(n->position);
+      return false;
+    }
+    for (int spin = 0; spin < helpAfter; ++spin) {
+      if (published.load(memory_order_acquire))
+	return false;
+      std::this_thread::yield();
+    }
+    if (!published.load(memory_order_acquire)) {
+      INSTR_COUNT(SPLIT_HELPS, 1);
+      splitFull(n->position);
+    }
+    return false;
+  }
+
+  // What a splitter leaves in a slot nobody had written yet.
+  static Node* sealed() {
+    static Node seal;
+    return &seal;
+  }
+
+  // Empty the slots taken since the last settle(), ready for new inserts.
+  void clearSlots() {
+    atomic<Node*>* s = slots.load();
+    uint32_t used = min(reserved.load(), slotCapacity);
+    for (uint32_t k = 0; s && k < used; ++k)
+      s[k].store(nullptr, memory_order_relaxed);
+    reserved = 0;
+  }
+
+  // The leaf's slots, taken from the pool the first time they are
+  // needed. Without a pool, the cell allocates its own and keeps them
+  // across resets. Slots taken by a thread that loses the race stay
+  // unused until the pool's reset().
+  atomic<Node*>* slotArray() {
+    atomic<Node*>* s = slots.load(memory_order_acquire);
+    if (s)
+      return s;
+    atomic<Node*>* fresh = pool ? pool->allocSlots(threshold) : nullptr;
+    bool own = !fresh;
+    if (own) {
+      fresh = new atomic<Node*>[threshold];
+      for (int k = 0; k < threshold; ++k)
+	fresh[k].store(nullptr, memory_order_relaxed);
+      if (pool)
+	pool->allocations++;
+    }
+    if (slots.compare_exchange_strong(s, fresh, memory_order_acq_rel)) {
+      slotCapacity = threshold;
+      ownSlots = own;
+      return fresh;
+    }
+    if (own)
+      delete[] fresh;
+    return s;
+  }
+
+  // Split a full leaf. hint is the center if every slot had to be sealed.
+  void splitFull(const glm::vec3& hint) {
+    // Fix the members without waiting for anyone: a slot either holds its
+    // particle by now or is sealed, and then stays that way.
+    uint32_t free = room();
+    atomic<Node*>* s = slotArray();
+    for (uint32_t k = 0; k < free; ++k) {
+      Node* empty = nullptr;
+      s[k].compare_exchange_strong(empty, sealed(), memory_order_acq_rel);
+    }
+    if (published.load(memory_order_acquire))
+      return;
+
+    uint32_t members = nodes.size();
+    for (uint32_t k = 0; k < free; ++k)
+      members += s[k].load(memory_order_acquire) != sealed();
+    auto forMembers = [&](auto f) {
+      for (auto n : nodes)
+	f(n);
+      for (uint32_t k = 0; k < free; ++k) {
+	Node* n = s[k].load(memory_order_acquire);
+	if (n != sealed())
+	  f(n);
+      }
+    };
+
+    splitBlock* b = nullptr;
+    otNodeT* block = pool ? pool->allocBlock(threshold, &b) : nullptr;
+    if (!b)
+      b = new splitBlock;
+    b->center = glm::vec3(0);
+    forMembers([&](Node* n) { b->center += n->position; });
+    b->center = members ? b->center / float(members) : hint;
+    for (int i = 0; i < 8; ++i) {
+      b->children[i] = block ? block + i : new otNodeT(threshold);
+      b->children[i]->reserveLeaf();
+    }
+    // Nobody else can see these children yet.
+    forMembers([&](Node* n) { b->children[octant(n->position, b->center)]->insert(n); });
+
+    splitBlock* expected = nullptr;
+    if (!published.compare_exchange_strong(expected, b, memory_order_acq_rel)) {
+      // In an arena the block waits for the pool's reset().
+      INSTR_COUNT(SPLIT_DISCARDS, 1);
+      if (!pool) {
+	for (auto c : b->children)
+	  delete c;
+	delete b;
+      }
+    }
+  }
+
+  // Fold a leaf's lock-free inserts into nodes, or adopt its split.
+  void settle() {
+    if (type == NODE)
+      return;
+    if (splitBlock* s = published.load()) {
+      center = s->center;
+      children.assign(s->children, s->children + 8);
+      nodes.clear();
+      type = NODE;
+    }
+    else if (uint32_t used = min(reserved.load(), room())) {
+      atomic<Node*>* s = slots.load();
+      // Sized for a full leaf, so a recycled cell never has to grow.
+      track(nodes, nodes.size() + used);
+      if (nodes.size() + used > nodes.capacity())
+	nodes.reserve(threshold);
+      for (uint32_t k = 0; k < used; ++k) {
+	Node* n = s[k].load();
+	if (n && n != sealed())
+	  nodes.push_back(n);
+      }
+    }
+    clearSlots();
+  }
+
+  // The mutex version of insert(), kept for comparison.
+  void insertLocked(Node* n) {
     if (type == NODE) {
-      glm::vec3 cmp = glm::greaterThan(n->position, center);
-      int oct = cmp.x * 2 + cmp.y * 1 + cmp.z * 4;
-      children[oct]->insert(n);
+      children[octant(n->position, center)]->insertLocked(n);
     }
     else {
       // LEAF
-      lock.lock();
+      INSTR_LOCK(lock);
       // If this became a NODE while we were waiting for the lock then we
       // reinsert and folow the NODE path.
       if (type == NODE) {
 	lock.unlock();
-	this->insert(n);
+	this->insertLocked(n);
       }
       else {
+	// A leaf never holds more than threshold particles before it
+	// splits, so a recycled cell sized for that never has to grow.
+	if (nodes.empty()) {
+	  track(nodes, threshold);
+	  nodes.reserve(threshold);
+	}
 	nodes.push_back(n);
 	if (nodes.size() >= threshold) {
 	  // Initialize child nodes.
-	  for (int i = 0; i < 8; ++i) {
-	    children.push_back(new otNode(threshold));
-	  }
+	  split();
 
 	  // Calculate the center of the points
 	  for (auto& n : nodes) {
@@ -214,67 +855,930 @@ public:
 	  lock.unlock();
 	  std::for_each(std::execution::par_unseq, nodes.begin(), nodes.end(),
 		  [&](auto n) {
-		    insert(n);
+		    INSTR_SCOPE("insert");
+		    insertLocked(n);
 		  });
 	} else {
 	  lock.unlock();
 	}
       } // if (nodes.size() == threshold)
     } // else
-  } // void insert(Node* n)
+  } // void insertLocked(Node* n)
+
+  // Morton ordered build. Instead of pushing every particle through the
+  // leaf locks we key each particle by its position on a Z-order curve,
+  // radix sort the keys and cut the sorted run into cells top down. Cells
+  // split on the same octant numbering as insert() so the two are
+  // interchangeable for updateStats() and calcForces().
+  //
+  // The cells are otNodeT like any other, linked by children pointers,
+  // not a flat array indexed from the root: updateStats(), refit(),
+  // insert() and every walk take the same tree whichever way it was
+  // built. With an arena each cell's eight children are one contiguous
+  // block, and its particles a contiguous Morton run; compactTree.h
+  // flattens a finished tree into an index based array for the walk.
+  static const int mortonLevels = 21;
+
+  static uint64_t spreadBits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+  }
+
+  static uint64_t mortonKey(const glm::vec3& p, const glm::vec3& origin, float scale) {
+    const float cells = float(1 << mortonLevels);
+    glm::vec3 q = (p - origin) * scale;
+    uint64_t x = min(uint64_t(max(q.x, 0.0f)), uint64_t(cells - 1));
+    uint64_t y = min(uint64_t(max(q.y, 0.0f)), uint64_t(cells - 1));
+    uint64_t z = min(uint64_t(max(q.z, 0.0f)), uint64_t(cells - 1));
+    // Octant digit is x * 2 + y * 1 + z * 4, matching insert().
+    return spreadBits(x) << 1 | spreadBits(y) | spreadBits(z) << 2;
+  }
+
+  // Parallel LSD radix sort, 8 bits per pass. Each chunk histograms its
+  // slice, a serial scan turns the histograms into output offsets and the
+  // chunks then scatter independently, which keeps every pass stable.
+  static size_t sortChunks(size_t n) {
+    return max<size_t>(1, min<size_t>(n / 4096, thread::hardware_concurrency() * 4));
+  }
+
+  static void radixSort(sortScratch_t& scratch) {
+    auto& keys = scratch.keys;
+    auto& tmp = scratch.tmp;
+    auto& chunks = scratch.chunks;
+    auto& offsets = scratch.offsets;
+    const size_t n = keys.size();
+    const size_t numChunks = chunks.size();
+    const size_t chunkSize = (n + numChunks - 1) / numChunks;
+
+    for (int shift = 0; shift < 3 * mortonLevels; shift += 8) {
+      std::for_each(std::execution::par_unseq, chunks.begin(), chunks.end(),
+		    [&](size_t c) {
+		      auto& h = offsets[c];
+		      h.fill(0);
+		      size_t end = min(n, (c + 1) * chunkSize);
+		      for (size_t i = c * chunkSize; i < end; ++i)
+			h[(keys[i].first >> shift) & 0xff]++;
+		    });
+
+      size_t sum = 0;
+      bool skip = false;
+      for (int d = 0; d < 256; ++d) {
+	size_t digitCount = 0;
+	for (size_t c = 0; c < numChunks; ++c) {
+	  size_t cnt = offsets[c][d];
+	  offsets[c][d] = sum;
+	  sum += cnt;
+	  digitCount += cnt;
+	}
+	// Every key has the same digit, nothing to do for this pass.
+	if (digitCount == n)
+	  skip = true;
+      }
+      if (skip)
+	continue;
+
+      std::for_each(std::execution::par_unseq, chunks.begin(), chunks.end(),
+		    [&](size_t c) {
+		      auto& h = offsets[c];
+		      size_t end = min(n, (c + 1) * chunkSize);
+		      for (size_t i = c * chunkSize; i < end; ++i)
+			tmp[h[(keys[i].first >> shift) & 0xff]++] = keys[i];
+		    });
+      keys.swap(tmp);
+    }
+  }
+
+  static bbox_t boundsOf(nodeArray nodes) {
+    return std::transform_reduce(std::execution::par_unseq,
+				 nodes.begin(), nodes.end(), bbox_t(),
+				 [](bbox_t a, const bbox_t& b) {
+				   return a += b;
+				 },
+				 [](const Node& n) {
+				   bbox_t b;
+				   b += n.position;
+				   return b;
+				 });
+  }
+
+  void insertSorted(nodeArray nodes) {
+    if (nodes.empty())
+      return;
+
+    bbox_t bounds = boundsOf(nodes);
+    sortScratch_t local;
+    sortScratch_t& scratch = pool ? pool->scratch : local;
+    float size = sortKeys(scratch, nodes.size(), bounds,
+			  [&](size_t i) { return nodes[i].position; });
+
+    auto& keys = scratch.keys;
+    build(keys.data(), keys.data() + keys.size(), keys.data(), nodes.data(),
+	  bounds.min, size, 0);
+  }
+
+  // Permute the particles themselves into Morton order, so that particles
+  // walked one after another in the force pass meet the same cells and
+  // each leaf's particles sit next to each other in memory. Node::id moves
+  // with its particle. Pointers into nodes, including any tree built over
+  // them, are stale afterwards.
+  void reorder(nodeArray nodes) {
+    if (nodes.empty())
+      return;
+
+    bbox_t bounds = boundsOf(nodes);
+    sortScratch_t local;
+    sortScratch_t& scratch = pool ? pool->scratch : local;
+    sortKeys(scratch, nodes.size(), bounds,
+	     [&](size_t i) { return nodes[i].position; });
+
+    auto& keys = scratch.keys;
+    auto& spare = scratch.spareNodes;
+    track(spare, nodes.size());
+    spare.resize(nodes.size());
+    std::for_each(std::execution::par_unseq, keys.begin(), keys.end(),
+		  [&](const mortonKey_t& k) {
+		    spare[&k - keys.data()] = nodes[k.second];
+		  });
+    std::copy(std::execution::par_unseq, spare.begin(), spare.end(), nodes.begin());
+  }
 
-  void calcForces(vector<Node>& nodes, float theta) {
+  // SoA build. The particles are permuted into Morton order so every cell
+  // is simply the index range [first, first + count).
+  void insertSorted(Particles& p) {
+    if (p.size() == 0)
+      return;
+
+    bbox_t bounds = std::transform_reduce(std::execution::par_unseq,
+					  p.x.begin(), p.x.end(), bbox_t(),
+					  [](bbox_t a, const bbox_t& b) {
+					    return a += b;
+					  },
+					  [&](const float& x) {
+					    bbox_t b;
+					    b += p.position(&x - p.x.data());
+					    return b;
+					  });
+    sortScratch_t local;
+    sortScratch_t& scratch = pool ? pool->scratch : local;
+    float size = sortKeys(scratch, p.size(), bounds,
+			  [&](size_t i) { return p.position(i); });
+
+    auto& keys = scratch.keys;
+    p.permute(keys);
+    build(keys.data(), keys.data() + keys.size(), keys.data(), nullptr,
+	  bounds.min, size, 0);
+  }
+
+  // SoA build from arrays we do not own: pos(i) and mass(i) give particle
+  // i, which is read once, already in Morton order, into p with p.id[j] =
+  // i. Velocities start at zero.
+  template<typename Pos, typename Mass>
+  void insertSorted(Particles& p, size_t n, Pos pos, Mass mass) {
+    p.resize(n);
+    if (n == 0)
+      return;
+    std::iota(p.id.begin(), p.id.end(), 0);
+    bbox_t bounds = std::transform_reduce(std::execution::par_unseq,
+					  p.id.begin(), p.id.end(), bbox_t(),
+					  [](bbox_t a, const bbox_t& b) {
+					    return a += b;
+					  },
+					  [&](uint32_t i) {
+					    bbox_t b;
+					    b += pos(i);
+					    return b;
+					  });
+    sortScratch_t local;
+    sortScratch_t& scratch = pool ? pool->scratch : local;
+    float size = sortKeys(scratch, n, bounds, pos);
+
+    auto& keys = scratch.keys;
+    std::for_each(std::execution::par_unseq, keys.begin(), keys.end(),
+		  [&](const mortonKey_t& k) {
+		    size_t j = &k - keys.data();
+		    glm::vec3 q = pos(k.second);
+		    p.x[j] = q.x;
+		    p.y[j] = q.y;
+		    p.z[j] = q.z;
+		    p.weight[j] = mass(k.second);
+		    p.vx[j] = p.vy[j] = p.vz[j] = 0;
+		    p.id[j] = k.second;
+		  });
+    build(keys.data(), keys.data() + keys.size(), keys.data(), nullptr,
+	  bounds.min, size, 0);
+  }
+
+  // Fill scratch.keys with the sorted Morton keys of n particles inside
+  // bounds and return the edge length of the cube they were keyed in.
+  template<typename Pos>
+  float sortKeys(sortScratch_t& scratch, size_t n, const bbox_t& bounds, Pos pos) {
+    glm::vec3 extent = bounds.max - bounds.min;
+    float size = max(max(extent.x, extent.y), extent.z);
+    if (size <= 0.0f)
+      size = 1.0f;
+    float scale = float(1 << mortonLevels) / size;
+
+    size_t grown = scratch.prepare(n, sortChunks(n));
+    if (pool)
+      pool->allocations += grown;
+
+    auto& keys = scratch.keys;
+    std::for_each(std::execution::par_unseq, keys.begin(), keys.end(),
+		  [&](mortonKey_t& k) {
+		    INSTR_SCOPE("keys");
+		    uint32_t i = &k - keys.data();
+		    k = mortonKey_t(mortonKey(pos(i), bounds.min, scale), i);
+		  });
+    radixSort(scratch);
+    return size;
+  }
+
+  // Cut the sorted run [first, last) into this cell. keys is the start of
+  // the whole run, so leaves know their index range; base is the particle
+  // array when leaves should also hold pointers.
+  void build(const mortonKey_t* first, const mortonKey_t* last,
+	     const mortonKey_t* keys, Node* base,
+	     const glm::vec3& corner, float size, int level) {
+    size_t count = last - first;
+    this->first = first - keys;
+    this->count = count;
+    if (count < size_t(threshold) || level == mortonLevels) {
+      if (base) {
+	track(nodes, count);
+	nodes.reserve(count);
+	for (auto k = first; k != last; ++k)
+	  nodes.push_back(base + k->second);
+      }
+      return;
+    }
+
+    type = NODE;
+    center = corner + glm::vec3(size / 2.0f);
+    int shift = 3 * (mortonLevels - 1 - level);
+    const mortonKey_t* bounds[9];
+    bounds[0] = first;
+    split();
+    for (int i = 0; i < 8; ++i) {
+      bounds[i + 1] = std::partition_point(bounds[i], last,
+					   [&](const mortonKey_t& k) {
+					     return int((k.first >> shift) & 7) <= i;
+					   });
+    }
+
+    float half = size / 2.0f;
+    auto buildChild = [&](int i) {
+      INSTR_SCOPE("build");
+      glm::vec3 c = corner + glm::vec3((i >> 1) & 1, i & 1, (i >> 2) & 1) * half;
+      children[i]->build(bounds[i], bounds[i + 1], keys, base, c, half, level + 1);
+    };
+    // Only fan out while there is enough work to be worth a task.
+    if (count > 4096) {
+      int octs[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+      std::for_each(std::execution::par_unseq, octs, octs + 8, buildChild);
+    }
+    else {
+      for (int i = 0; i < 8; ++i)
+	buildChild(i);
+    }
+  }
+
+  // Top down build. The particle pointers are partitioned in place into
+  // the eight octants of each cell, three partitions per level, and every
+  // child holding more than grain particles is built as a TBB task while
+  // the small ones are built inline. Nothing is shared between subtrees,
+  // so no locks are taken, and an octant that ends up with most of the
+  // particles simply splits again as a task of its own.
+  void buildTopDown(nodeArray nodes, size_t grain = 4096) {
+    if (nodes.empty())
+      return;
+
+    bbox_t bounds = boundsOf(nodes);
+    glm::vec3 extent = bounds.max - bounds.min;
+    float size = max(extent.x, max(extent.y, extent.z));
+
+    sortScratch_t local;
+    auto& ptrs = (pool ? pool->scratch : local).pointers;
+    track(ptrs, nodes.size());
+    ptrs.resize(nodes.size());
+    std::for_each(std::execution::par_unseq, nodes.begin(), nodes.end(),
+		  [&](Node& n) {
+		    ptrs[&n - nodes.data()] = &n;
+		  });
+    buildRange(ptrs.data(), ptrs.data() + ptrs.size(), ptrs.data(),
+	       bounds.min, size, 0, grain);
+  }
+
+  void buildRange(Node** first, Node** last, Node** base,
+		  const glm::vec3& corner, float size, int level, size_t grain) {
+    size_t count = last - first;
+    this->first = first - base;
+    this->count = count;
+    if (count < size_t(threshold) || level == mortonLevels) {
+      track(nodes, count);
+      nodes.assign(first, last);
+      return;
+    }
+
+    type = NODE;
+    center = corner + glm::vec3(size / 2.0f);
+    split();
+
+    // Same octant numbering as insert(): x * 2 + y * 1 + z * 4. Large
+    // ranges are partitioned in parallel so the top levels, which see
+    // every particle, do not serialise the build.
+    auto part = [&](Node** lo, Node** hi, int axis) {
+      auto below = [&](Node* n) { return n->position[axis] <= center[axis]; };
+      if (size_t(hi - lo) > 16 * grain)
+	return std::partition(std::execution::par, lo, hi, below);
+      return std::partition(lo, hi, below);
+    };
+    Node** bounds[9];
+    bounds[0] = first;
+    bounds[8] = last;
+    bounds[4] = part(first, last, 2);
+    for (int z = 0; z < 8; z += 4) {
+      bounds[z + 2] = part(bounds[z], bounds[z + 4], 0);
+      for (int x = 0; x < 4; x += 2)
+	bounds[z + x + 1] = part(bounds[z + x], bounds[z + x + 2], 1);
+    }
+
+    float half = size / 2.0f;
+    auto buildChild = [=](int i) {
+      INSTR_SCOPE("build");
+      glm::vec3 c = corner + glm::vec3((i >> 1) & 1, i & 1, (i >> 2) & 1) * half;
+      children[i]->buildRange(bounds[i], bounds[i + 1], base, c, half, level + 1, grain);
+    };
+    tbb::task_group tasks;
+    for (int i = 0; i < 8; ++i) {
+      if (size_t(bounds[i + 1] - bounds[i]) > grain)
+	tasks.run([=] { buildChild(i); });
+    }
+    for (int i = 0; i < 8; ++i) {
+      if (size_t(bounds[i + 1] - bounds[i]) <= grain)
+	buildChild(i);
+    }
+    tasks.wait();
+  }
+
+  // Refit. Keep last step's topology and only move the particles that
+  // left their leaf's region, which is bounded by the centers of the
+  // cells above it exactly as insert() would route them. Emptied leaves
+  // are not merged and reinserted particles pile into whatever cells are
+  // there, so the tree degrades as more particles move; refit() gives up
+  // and returns false, asking for a full rebuild, once more than maxMoved
+  // of the particles left their leaf or the tree is deeper than maxDepth.
+  struct refitStats {
+    size_t particles = 0;
+    size_t moved = 0;
+    size_t leaves = 0;
+    size_t emptyLeaves = 0;
+    int maxDepth = 0;
+
+    refitStats& operator+=(const refitStats& r) {
+      particles += r.particles;
+      moved += r.moved;
+      leaves += r.leaves;
+      emptyLeaves += r.emptyLeaves;
+      maxDepth = max(maxDepth, r.maxDepth);
+      return *this;
+    }
+  };
+
+  bool refit(float maxMoved, int maxDepth, refitStats* stats = nullptr) {
+    vector<Node*> moved;
+    std::mutex movedLock;
+    const float inf = std::numeric_limits<float>::infinity();
+    refitStats st = collectMoved(glm::vec3(-inf), glm::vec3(inf), 0, moved, movedLock, true);
+    if (stats)
+      *stats = st;
+    if (st.maxDepth > maxDepth || st.moved > maxMoved * st.particles)
+      return false;
+
+    std::for_each(std::execution::par_unseq, moved.begin(), moved.end(),
+		  [&](Node* n) {
+		    insert(n);
+		  });
+    return true;
+  }
+
+  // A particle stays in the cell bounded by (lo, hi].
+  refitStats collectMoved(const glm::vec3& lo, const glm::vec3& hi, int depth,
+			  vector<Node*>& moved, std::mutex& movedLock, bool parallel) {
+    refitStats st;
+    if (type == NODE) {
+      refitStats childStats[8];
+      auto refitChild = [&](int i) {
+	// Same octant numbering as insert(): x * 2 + y * 1 + z * 4.
+	int upper[3] = { (i >> 1) & 1, i & 1, (i >> 2) & 1 };
+	glm::vec3 clo = lo, chi = hi;
+	for (int a = 0; a < 3; ++a) {
+	  if (upper[a])
+	    clo[a] = center[a];
+	  else
+	    chi[a] = center[a];
+	}
+	childStats[i] = children[i]->collectMoved(clo, chi, depth + 1, moved, movedLock, false);
+      };
+      if (parallel) {
+	int octs[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	std::for_each(std::execution::par, octs, octs + 8, refitChild);
+      }
+      else {
+	for (int i = 0; i < 8; ++i)
+	  refitChild(i);
+      }
+      for (auto& c : childStats)
+	st += c;
+      return st;
+    }
+
+    auto stay = std::partition(nodes.begin(), nodes.end(),
+			       [&](Node* n) {
+				 return glm::all(glm::greaterThan(n->position, lo)) &&
+				   glm::all(glm::lessThanEqual(n->position, hi));
+			       });
+    if (stay != nodes.end()) {
+      std::lock_guard<std::mutex> guard(movedLock);
+      moved.insert(moved.end(), stay, nodes.end());
+    }
+    st.particles = nodes.size();
+    st.moved = nodes.end() - stay;
+    nodes.erase(stay, nodes.end());
+    st.leaves = 1;
+    st.emptyLeaves = nodes.empty();
+    st.maxDepth = depth;
+    return st;
+  }
+
+  // Opening criteria for the per particle walks. Each is asked, for a
+  // particle at p, whether a cell may be taken as a whole.
+  //
+  // geometricOpening is the classic distance / bboxSize > theta. With
+  // quadrupoles the particle must also be outside the sphere of radius
+  // bmax, where the expansion diverges: a loose theta, or a flat cell
+  // whose bboxSize is small next to its extent, would otherwise accept
+  // cells the particle is almost inside, and there the quadrupole term
+  // makes the force worse rather than better.
+  //
+  // relativeOpening bounds the error instead: a cell's multipole
+  // expansion is off by about M bmax^2 / d^4 for monopoles, and a further
+  // factor bmax / d with quadrupoles, where bmax bounds how far its mass
+  // lies from baryCenter. The cell is accepted when that is below limit,
+  // the tolerance times the particle's acceleration from the previous
+  // step, and the particle is outside the sphere of radius bmax.
+  //
+  // Both work on any cell type with those members, see compactTree.h.
+  struct geometricOpening {
+    float theta;
+    int order;
+    template<typename Cell>
+    bool operator()(const Cell& c, const glm::vec3& p) const {
+      float d = glm::distance(p, c.baryCenter);
+      return d / c.bboxSize > theta && (order == 1 || d > c.bmax);
+    }
+  };
+  struct relativeOpening {
+    float limit;
+    int order;
+    template<typename Cell>
+    bool operator()(const Cell& c, const glm::vec3& p) const {
+      glm::vec3 d = p - c.baryCenter;
+      float d2 = glm::dot(d, d);
+      float b2 = c.bmax * c.bmax;
+      if (d2 <= b2)
+	return false;
+      float error = c.weight * b2 / (d2 * d2);
+      if (order > 1)
+	error *= c.bmax / std::sqrt(d2);
+      return error < limit;
+    }
+  };
+
+  void calcForces(nodeArray nodes, float theta) {
     std::for_each(std::execution::par_unseq, nodes.begin(), nodes.end(),
 		  [&](auto& n) {
+		    INSTR_SCOPE("forces");
 		    n.velocity += calcForce(&n, theta);
 		  });
   }
+  // Forces with relativeOpening at tolerance alpha. lastForce holds the
+  // magnitude of each particle's force from the previous call, indexed by
+  // Node::id, and is updated; particles without one, as on the first
+  // step, use geometricOpening at theta.
+  void calcForces(nodeArray nodes, float alpha, float theta, vector<float>& lastForce) {
+    lastForce.resize(nodes.size());
+    std::for_each(std::execution::par_unseq, nodes.begin(), nodes.end(),
+		  [&](auto& n) {
+		    INSTR_SCOPE("forces");
+		    float& last = lastForce[n.id];
+		    float limit = alpha * last / n.weight;
+		    accum_t f = last > 0 ? walk(&n, relativeOpening{ limit, order })
+		      : walk(&n, geometricOpening{ theta, order });
+		    n.velocity += glm::vec3(f);
+		    last = glm::length(glm::vec3(f));
+		  });
+  }
   glm::vec3 calcForce(Node* n, float theta) {
-    glm::vec3 f(0);
+    return glm::vec3(walk(n, geometricOpening{ theta, order }));
+  }
+  template<typename Accept>
+  accum_t walk(Node* n, const Accept& accept) {
+    accum_t f(0);
     if (type == NODE) {
-      float distance = glm::distance(n->position, baryCenter);
-      if (distance / bboxSize > theta) {
-	f = force(n->position, n->weight, baryCenter, weight);
+      if (accept(*this, n->position)) {
+	INSTR_COUNT(CELL_INTERACTIONS, 1);
+	f = cellForce(n->position, n->weight);
       }
       else {
+	INSTR_COUNT(CELL_OPENINGS, 1);
 	for (auto& c : children) {
-	  f += c->calcForce(n, theta);
+	  f += c->walk(n, accept);
 	}
       }
     }
     else {
+      INSTR_COUNT(PARTICLE_INTERACTIONS, nodes.size());
       for (auto& c : nodes) {
 	if (c == n) continue;
-	f += force(n->position, n->weight, c->position, c->weight);
+	f += Law::force(n->position, n->weight, c->position, c->weight);
+      }
+    }
+    return f;
+  }
+
+  void calcForces(Particles& p, float theta) {
+    std::for_each(std::execution::par_unseq, p.x.begin(), p.x.end(),
+		  [&](float& x) {
+		    INSTR_SCOPE("forces");
+		    size_t i = &x - p.x.data();
+		    glm::vec3 f = calcForce(p, i, theta);
+		    p.vx[i] += f.x;
+		    p.vy[i] += f.y;
+		    p.vz[i] += f.z;
+		  });
+  }
+  // As above, with lastForce indexed by Particles::id.
+  void calcForces(Particles& p, float alpha, float theta, vector<float>& lastForce) {
+    lastForce.resize(p.size());
+    std::for_each(std::execution::par_unseq, p.x.begin(), p.x.end(),
+		  [&](float& x) {
+		    INSTR_SCOPE("forces");
+		    size_t i = &x - p.x.data();
+		    float& last = lastForce[p.id[i]];
+		    float limit = alpha * last / p.weight[i];
+		    accum_t f = last > 0 ? walk(p, i, relativeOpening{ limit, order })
+		      : walk(p, i, geometricOpening{ theta, order });
+		    p.vx[i] += f.x;
+		    p.vy[i] += f.y;
+		    p.vz[i] += f.z;
+		    last = glm::length(glm::vec3(f));
+		  });
+  }
+  glm::vec3 calcForce(const Particles& p, uint32_t n, float theta) {
+    return glm::vec3(walk(p, n, geometricOpening{ theta, order }));
+  }
+  template<typename Accept>
+  accum_t walk(const Particles& p, uint32_t n, const Accept& accept) {
+    accum_t f(0);
+    glm::vec3 pos = p.position(n);
+    if (type == NODE) {
+      if (accept(*this, pos)) {
+	INSTR_COUNT(CELL_INTERACTIONS, 1);
+	f = cellForce(pos, p.weight[n]);
+      }
+      else {
+	INSTR_COUNT(CELL_OPENINGS, 1);
+	for (auto& c : children) {
+	  f += c->walk(p, n, accept);
+	}
       }
     }
+    else {
+      INSTR_COUNT(PARTICLE_INTERACTIONS, count);
+      f = leafForce(p, first, first + count, n);
+    }
     return f;
   }
 
-  void updatePositions(vector<Node>& nodes) {
+  // Group walk. Rather than walking the tree once per particle, walk it
+  // once per leaf bucket, accepting a cell only when it is far enough
+  // from every particle in the bucket, and collect what is left into a
+  // cell list and a particle list. Both lists are then applied to every
+  // particle of the bucket in a tight loop.
+  struct interactionList {
+    vector<const otNodeT*> cells;               // accepted cells
+    vector<pair<uint32_t, uint32_t>> ranges;   // particles [first, end)
+  };
+
+  void calcForcesGrouped(Particles& p, float theta) {
+    vector<otNodeT*> leaves;
+    collectLeaves(leaves);
+    std::for_each(std::execution::par, leaves.begin(), leaves.end(),
+		  [&](otNodeT* leaf) {
+		    INSTR_SCOPE("forces");
+		    thread_local interactionList list;
+		    list.cells.clear();
+		    list.ranges.clear();
+		    interactions(leaf->bbox, theta, list);
+		    leaf->applyInteractions(p, list);
+		  });
+  }
+
+  void collectLeaves(vector<otNodeT*>& leaves) {
+    if (type == NODE) {
+      for (auto& c : children)
+	c->collectLeaves(leaves);
+    }
+    else if (count) {
+      leaves.push_back(this);
+    }
+  }
+
+  // Group walk that keeps each bucket's lists from one step to the next.
+  // The lists are built with a margin: a cell is only accepted if it
+  // would still be with the bucket margin closer and the cell margin
+  // larger. A particle moving d moves a baryCenter at most d, a bucket's
+  // bbox corner sqrt(3) d and a cell's size 2 d, so that holds as long as
+  // none has moved more than a third of the margin since. Until one has,
+  // the caller keeps the tree, only updating its stats, and the lists are
+  // applied again without walking it. Once one has, or after a rebuild,
+  // the lists are walked afresh.
+  struct interactionCache {
+    float margin;
+    size_t hits = 0;     // buckets that reused their lists
+    size_t misses = 0;   // buckets that walked the tree
+    vector<otNodeT*> leaves;
+    vector<interactionList> lists;
+    Particles::array_t x, y, z;   // positions when the lists were built
+    bool built = false;
+
+    interactionCache(float margin = 0) : margin(margin) { }
+
+    // Forget the lists, as after the tree has been rebuilt.
+    void invalidate() { built = false; }
+
+    bool valid(const Particles& p) const {
+      if (!built || p.size() != x.size())
+	return false;
+      float limit = margin * margin / 9;
+      return std::all_of(std::execution::par_unseq, p.x.begin(), p.x.end(),
+			 [&](const float& px) {
+			   size_t i = &px - p.x.data();
+			   glm::vec3 d = p.position(i) - glm::vec3(x[i], y[i], z[i]);
+			   return glm::dot(d, d) <= limit;
+			 });
+    }
+
+    double hitRate() const {
+      return hits + misses ? double(hits) / (hits + misses) : 0;
+    }
+  };
+
+  void calcForcesGrouped(Particles& p, float theta, interactionCache& cache) {
+    if (!cache.valid(p)) {
+      cache.leaves.clear();
+      collectLeaves(cache.leaves);
+      cache.lists.resize(cache.leaves.size());
+      std::for_each(std::execution::par, cache.leaves.begin(), cache.leaves.end(),
+		    [&](otNodeT*& leaf) {
+		      INSTR_SCOPE("interactions");
+		      interactionList& list = cache.lists[&leaf - cache.leaves.data()];
+		      list.cells.clear();
+		      list.ranges.clear();
+		      interactions(leaf->bbox, theta, list, cache.margin);
+		    });
+      cache.x = p.x;
+      cache.y = p.y;
+      cache.z = p.z;
+      cache.built = true;
+      cache.misses += cache.leaves.size();
+    }
+    else {
+      cache.hits += cache.leaves.size();
+    }
+    std::for_each(std::execution::par, cache.leaves.begin(), cache.leaves.end(),
+		  [&](otNodeT*& leaf) {
+		    INSTR_SCOPE("forces");
+		    leaf->applyInteractions(p, cache.lists[&leaf - cache.leaves.data()]);
+		  });
+  }
+
+  // Bucket-vs-cell version of the calcForce() walk. The distance used is
+  // from the baryCenter to the nearest point of the bucket's bbox, so a
+  // cell accepted here would be accepted for every particle in it.
+  void interactions(const bbox_t& bucket, float theta, interactionList& list,
+		    float margin = 0) const {
+    if (type == NODE) {
+      glm::vec3 gap = glm::max(glm::max(bucket.min - baryCenter, baryCenter - bucket.max),
+			       glm::vec3(0));
+      float d = glm::length(gap) - margin;
+      if (d / (bboxSize + margin) > theta && (order == 1 || d > bmax)) {
+	list.cells.push_back(this);
+      }
+      else {
+	INSTR_COUNT(CELL_OPENINGS, 1);
+	for (auto& c : children) {
+	  c->interactions(bucket, theta, list, margin);
+	}
+      }
+    }
+    else if (count) {
+      list.ranges.push_back(make_pair(first, first + count));
+    }
+  }
+
+  void applyInteractions(Particles& p, const interactionList& list) {
+    INSTR_COUNT(CELL_INTERACTIONS, uint64_t(count) * list.cells.size());
+    for (auto& r : list.ranges)
+      INSTR_COUNT(PARTICLE_INTERACTIONS, uint64_t(count) * (r.second - r.first));
+    for (uint32_t n = first; n < first + count; ++n) {
+      glm::vec3 pos = p.position(n);
+      accum_t f(0);
+      for (auto c : list.cells) {
+	f += c->cellForce(pos, p.weight[n]);
+      }
+      for (auto& r : list.ranges) {
+	f += leafForce(p, r.first, r.second, n);
+      }
+      p.vx[n] += f.x;
+      p.vy[n] += f.y;
+      p.vz[n] += f.z;
+    }
+  }
+
+  // Neighbour search on the same tree, using the cell bboxes from the
+  // last updateStats(). store is whatever the tree was built over, a
+  // nodeArray or Particles, and results are indices into it. Both queries
+  // run in parallel over the query points and write into buffers the
+  // caller allocates, numQueries slices of maxPerQuery or k entries.
+  //
+  // radiusQuery() returns every particle within radius of each query in
+  // no particular order. counts[q] is the full number found, which may be
+  // more than the maxPerQuery stored, so the caller can retry larger.
+  template<typename Store>
+  void radiusQuery(const Store& store, const glm::vec3* queries, size_t numQueries,
+		   float radius, uint32_t maxPerQuery, uint32_t* indices,
+		   uint32_t* counts) const {
+    float r2 = radius * radius;
+    std::for_each(std::execution::par, queries, queries + numQueries,
+		  [&](const glm::vec3& q) {
+		    INSTR_SCOPE("neighbours");
+		    size_t k = &q - queries;
+		    uint32_t* out = indices + k * maxPerQuery;
+		    uint32_t found = 0;
+		    radiusWalk(store, q, r2, [&](uint32_t i) {
+			if (found < maxPerQuery)
+			  out[found] = i;
+			found++;
+		      });
+		    counts[k] = found;
+		  });
+  }
+
+  // knn() returns the k particles nearest each query, nearest first, with
+  // their squared distances. A query point on a particle finds that
+  // particle at distance 0. Slots past the number of particles hold ~0
+  // and infinity.
+  template<typename Store>
+  void knn(const Store& store, const glm::vec3* queries, size_t numQueries,
+	   uint32_t k, uint32_t* indices, float* dist2) const {
+    if (k == 0)
+      return;
+    std::for_each(std::execution::par, queries, queries + numQueries,
+		  [&](const glm::vec3& q) {
+		    INSTR_SCOPE("neighbours");
+		    size_t n = &q - queries;
+		    thread_local vector<pair<float, uint32_t>> heap;
+		    heap.clear();
+		    knnWalk(store, q, k, heap);
+		    std::sort_heap(heap.begin(), heap.end());
+		    for (uint32_t j = 0; j < k; ++j) {
+		      bool have = j < heap.size();
+		      indices[n * k + j] = have ? heap[j].second : ~0u;
+		      dist2[n * k + j] = have ? heap[j].first : numeric_limits<float>::infinity();
+		    }
+		  });
+  }
+
+  // Squared distance from p to the nearest point of the cell's bbox.
+  float gap2(const glm::vec3& p) const {
+    glm::vec3 gap = glm::max(glm::max(bbox.min - p, p - bbox.max), glm::vec3(0));
+    return glm::dot(gap, gap);
+  }
+
+  // Call f(position, index) for each particle of a leaf.
+  template<typename F>
+  void leafParticles(nodeArray store, F f) const {
+    for (auto n : nodes)
+      f(n->position, uint32_t(n - store.data()));
+  }
+  template<typename F>
+  void leafParticles(const Particles& store, F f) const {
+    for (uint32_t i = first; i < first + count; ++i)
+      f(store.position(i), i);
+  }
+
+  template<typename Store, typename F>
+  void radiusWalk(const Store& store, const glm::vec3& q, float r2, F&& found) const {
+    if (bbox.unset || gap2(q) > r2)
+      return;
+    if (type == NODE) {
+      for (auto& c : children)
+	c->radiusWalk(store, q, r2, found);
+    }
+    else {
+      leafParticles(store, [&](const glm::vec3& pos, uint32_t i) {
+	  glm::vec3 d = pos - q;
+	  if (glm::dot(d, d) <= r2)
+	    found(i);
+	});
+    }
+  }
+
+  // Depth first, nearest child first, pruning cells further away than the
+  // current k-th nearest. heap is a max heap on distance.
+  template<typename Store>
+  void knnWalk(const Store& store, const glm::vec3& q, uint32_t k,
+	       vector<pair<float, uint32_t>>& heap) const {
+    if (type == NODE) {
+      pair<float, const otNodeT*> childOrder[8];
+      int n = 0;
+      for (size_t i = 0; i < children.size() && i < 8; ++i) {
+	const otNodeT* c = children[i];
+	if (!c->bbox.unset)
+	  childOrder[n++] = make_pair(c->gap2(q), c);
+      }
+      // At most eight, so an insertion sort.
+      for (int i = 1; i < n; ++i)
+	for (int j = i; j > 0 && childOrder[j].first < childOrder[j - 1].first; --j)
+	  std::swap(childOrder[j], childOrder[j - 1]);
+      for (int i = 0; i < n; ++i) {
+	if (heap.size() == k && childOrder[i].first >= heap.front().first)
+	  break;
+	childOrder[i].second->knnWalk(store, q, k, heap);
+      }
+    }
+    else {
+      leafParticles(store, [&](const glm::vec3& pos, uint32_t i) {
+	  glm::vec3 d = pos - q;
+	  float r2 = glm::dot(d, d);
+	  if (heap.size() < k) {
+	    heap.push_back(make_pair(r2, i));
+	    std::push_heap(heap.begin(), heap.end());
+	  }
+	  else if (r2 < heap.front().first) {
+	    std::pop_heap(heap.begin(), heap.end());
+	    heap.back() = make_pair(r2, i);
+	    std::push_heap(heap.begin(), heap.end());
+	  }
+	});
+    }
+  }
+
+  void updatePositions(nodeArray nodes) {
     for (auto& n : nodes) {
       n.position += n.velocity;
     }
   }
+  void updatePositions(Particles& p) {
+    for (size_t i = 0; i < p.size(); ++i) {
+      p.x[i] += p.vx[i];
+      p.y[i] += p.vy[i];
+      p.z[i] += p.vz[i];
+    }
+  }
   
   struct debugData {
     int maxDepth = 0;
     int numLeafs = 0;
     int numInternalNodes = 0;
     int maxNumNodes = 0;
+    size_t bytes = 0;       // cells and their vectors' storage
+    size_t particles = 0;
   };
   void debug(debugData *d = nullptr, int depth = 0) {
     bool root = false;
+    debugData local;
     if (d == nullptr) {
       root = true;
-      d = new debugData();
+      d = &local;
     }
+    // insert() leaves the tree unusable until settle().
+    assert(type == NODE || (reserved == 0 && !published.load()));
+    d->bytes += sizeof(otNodeT) + nodes.capacity() * sizeof(Node*) +
+      children.capacity() * sizeof(otNodeT*) + slotCapacity * sizeof(atomic<Node*>);
     if (type == LEAF) {
       if (d->maxDepth < depth)
 	d->maxDepth = depth;
       d->numLeafs++;
-      if (nodes.size() > d->maxNumNodes)
-	d->maxNumNodes = nodes.size();
+      d->particles += leafSize();
+      if (leafSize() > size_t(d->maxNumNodes))
+	d->maxNumNodes = leafSize();
     }
     else {
       for (auto& c : children)
@@ -288,9 +1792,75 @@ public:
 	   << " numLeafs " << d->numLeafs
 	   << " numInternalNodes " << d->numInternalNodes
 	   << " maxNumNodes " << d->maxNumNodes
+	   << " bytesPerParticle " << double(d->bytes) / max<size_t>(d->particles, 1)
 	   << endl;
-      delete d;
     }
   }
 };
 
+template<typename Law>
+inline otPoolT<Law>::~otPoolT() {
+  for (size_t k = 0; k < chunks.size(); ++k) {
+    delete[] chunks[k].load();
+    delete[] splits[k];
+    delete[] slotChunks[k].load();
+  }
+}
+
+template<typename Law>
+inline otNodeT<Law>* otPoolT<Law>::allocBlock(int threshold, otSplitT<Law>** split) {
+  // Chunk k holds firstChunk << k blocks, so block i lives in chunk
+  // log2(i / firstChunk + 1) and chunks never move once published.
+  size_t i = next++;
+  size_t k = 63 - __builtin_clzll(i / firstChunk + 1);
+  otNodeT<Law>* chunk = chunks[k];
+  if (chunk == nullptr) {
+    std::lock_guard<std::mutex> guard(growLock);
+    chunk = chunks[k];
+    if (chunk == nullptr) {
+      size_t cells = 8 * (firstChunk << k);
+      chunk = new otNodeT<Law>[cells];
+      splits[k] = new otSplitT<Law>[firstChunk << k];
+      allocations += 2;
+      for (size_t c = 0; c < cells; ++c) {
+	chunk[c].pool = this;
+	chunk[c].reset(threshold);
+      }
+      chunks[k] = chunk;
+    }
+  }
+  size_t b = i - firstChunk * ((size_t(1) << k) - 1);
+  otNodeT<Law>* block = chunk + 8 * b;
+  for (int c = 0; c < 8; ++c)
+    block[c].reset(threshold);
+  if (split)
+    *split = splits[k] + b;
+  return block;
+}
+
+template<typename Law>
+inline atomic<Node*>* otPoolT<Law>::allocSlots(int threshold) {
+  size_t i = nextSlots++;
+  size_t k = 63 - __builtin_clzll(i / (8 * firstChunk) + 1);
+  atomic<Node*>* chunk = slotChunks[k];
+  if (chunk == nullptr) {
+    std::lock_guard<std::mutex> guard(growLock);
+    chunk = slotChunks[k];
+    if (chunk == nullptr) {
+      chunk = new atomic<Node*>[8 * (firstChunk << k) * threshold];
+      allocations++;
+      slotWidth[k] = threshold;
+      slotChunks[k] = chunk;
+    }
+  }
+  if (slotWidth[k] < threshold)
+    return nullptr;
+  size_t g = i - 8 * firstChunk * ((size_t(1) << k) - 1);
+  atomic<Node*>* s = chunk + g * slotWidth[k];
+  for (int j = 0; j < threshold; ++j)
+    s[j].store(nullptr, memory_order_relaxed);
+  return s;
+}
+
+typedef otNodeT<> otNode;
+typedef otPoolT<defaultLaw> otPool;
@@ -0,0 +1,163 @@
+#include "particleApi.h"
+
+#include <new>
+
+#include "octTree.h"
+
+// The C interface in particleApi.h. Everything behind it is the ordinary
+// SoA tree with the default force law; this file only adapts strided
+// caller arrays to it and keeps C++ exceptions from crossing the ABI.
+
+static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "queries are packed xyz triples");
+
+struct particleTree {
+  otPool pool;
+  otNode root;
+  Particles particles;
+  int threshold;
+  int order;
+  bool built = false;
+
+  particleTree(int threshold, int order)
+    : root(threshold, &pool), threshold(threshold), order(order) { }
+};
+
+namespace {
+
+// Element i of a strided float array, stride in bytes with 0 for packed.
+struct strided {
+  const char* base;
+  size_t stride;
+
+  strided(const float* p, size_t s) : base(reinterpret_cast<const char*>(p)),
+				      stride(s ? s : sizeof(float)) { }
+  float operator[](size_t i) const {
+    return *reinterpret_cast<const float*>(base + i * stride);
+  }
+};
+
+inline float& stridedOut(float* p, size_t stride, size_t i) {
+  return *reinterpret_cast<float*>(reinterpret_cast<char*>(p) +
+				   i * (stride ? stride : sizeof(float)));
+}
+
+template<typename F>
+int guarded(F f) {
+  try {
+    return f();
+  }
+  catch (const std::bad_alloc&) {
+    return PARTICLE_NO_MEMORY;
+  }
+  catch (...) {
+    return PARTICLE_ERROR;
+  }
+}
+
+// Map the tree's Morton ordered indices back to the caller's.
+void callerIndices(const particleTree* tree, uint32_t* indices, size_t n) {
+  std::for_each(std::execution::par_unseq, indices, indices + n,
+		[&](uint32_t& i) {
+		  if (i != ~0u)
+		    i = tree->particles.id[i];
+		});
+}
+
+} // namespace
+
+extern "C" {
+
+particleTree* particleTreeCreate(int threshold, int order) {
+  if (threshold < 1 || order < 1 || order > 2)
+    return nullptr;
+  try {
+    return new particleTree(threshold, order);
+  }
+  catch (...) {
+    return nullptr;
+  }
+}
+
+void particleTreeDestroy(particleTree* tree) {
+  delete tree;
+}
+
+int particleTreeBuild(particleTree* tree, size_t n,
+		      const float* x, const float* y, const float* z, size_t positionStride,
+		      const float* mass, size_t massStride) {
+  if (!tree || (n && (!x || !y || !z || !mass)) || n > numeric_limits<uint32_t>::max())
+    return PARTICLE_INVALID;
+  return guarded([&] {
+      tree->built = false;
+      strided px(x, positionStride), py(y, positionStride), pz(z, positionStride);
+      strided m(mass, massStride);
+      tree->pool.reset();
+      tree->root.reset(tree->threshold);
+      tree->root.insertSorted(tree->particles, n,
+			      [&](size_t i) { return glm::vec3(px[i], py[i], pz[i]); },
+			      [&](size_t i) { return m[i]; });
+      tree->root.updateStats(true, &tree->particles, tree->order);
+      tree->built = true;
+      return PARTICLE_OK;
+    });
+}
+
+size_t particleTreeSize(const particleTree* tree) {
+  return tree && tree->built ? tree->particles.size() : 0;
+}
+
+int particleTreeAccelerations(particleTree* tree, float theta,
+			      float* ax, float* ay, float* az, size_t stride) {
+  if (!tree || !tree->built || !ax || !ay || !az)
+    return PARTICLE_INVALID;
+  return guarded([&] {
+      Particles& p = tree->particles;
+      std::fill(p.vx.begin(), p.vx.end(), 0.0f);
+      std::fill(p.vy.begin(), p.vy.end(), 0.0f);
+      std::fill(p.vz.begin(), p.vz.end(), 0.0f);
+      tree->root.calcForces(p, theta);
+      std::for_each(std::execution::par_unseq, p.id.begin(), p.id.end(),
+		    [&](const uint32_t& id) {
+		      size_t j = &id - p.id.data();
+		      float inv = p.weight[j] > 0 ? 1.0f / p.weight[j] : 0.0f;
+		      stridedOut(ax, stride, id) = p.vx[j] * inv;
+		      stridedOut(ay, stride, id) = p.vy[j] * inv;
+		      stridedOut(az, stride, id) = p.vz[j] * inv;
+		    });
+      return PARTICLE_OK;
+    });
+}
+
+int particleTreeKnn(const particleTree* tree, const float* queries, size_t numQueries,
+		    uint32_t k, uint32_t* indices, float* dist2) {
+  if (!tree || !tree->built || (numQueries && k && (!queries || !indices || !dist2)))
+    return PARTICLE_INVALID;
+  return guarded([&] {
+      tree->root.knn(tree->particles, reinterpret_cast<const glm::vec3*>(queries),
+		     numQueries, k, indices, dist2);
+      callerIndices(tree, indices, numQueries * k);
+      return PARTICLE_OK;
+    });
+}
+
+int particleTreeRadius(const particleTree* tree, const float* queries, size_t numQueries,
+		       float radius, uint32_t maxPerQuery, uint32_t* indices, uint32_t* counts) {
+  if (!tree || !tree->built || (numQueries && (!queries || !counts)) ||
+      (numQueries && maxPerQuery && !indices))
+    return PARTICLE_INVALID;
+  return guarded([&] {
+      tree->root.radiusQuery(tree->particles, reinterpret_cast<const glm::vec3*>(queries),
+			     numQueries, radius, maxPerQuery, indices, counts);
+      // Only the stored part of each slice holds indices.
+      const vector<uint32_t>& id = tree->particles.id;
+      std::for_each(std::execution::par_unseq, counts, counts + numQueries,
+		    [&](const uint32_t& found) {
+		      uint32_t* out = indices + (&found - counts) * maxPerQuery;
+		      for (uint32_t j = 0; j < min(found, maxPerQuery); ++j)
+			out[j] = id[out[j]];
+		    });
+      return PARTICLE_OK;
+    });
+}
+
+} // extern "C"
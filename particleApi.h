@@ -0,0 +1,84 @@
+#ifndef PARTICLE_API_H
+#define PARTICLE_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* C interface to the octree, built as the particle library. Nothing here
+ * pulls in the C++ headers, so it can be used from C, from Fortran through
+ * iso_c_binding or from Python through ctypes or cffi.
+ *
+ * The caller owns all particle arrays. Every array is given as a pointer
+ * and a stride in bytes, 0 meaning tightly packed floats, so SoA arrays
+ * and interleaved xyz records (x = p, y = p + 1, z = p + 2, stride 12 or
+ * the record size) can both be passed as they are.
+ *
+ * The tree is not built over the caller's arrays. Every build copies the
+ * positions and masses, in Morton order, into the tree's own storage: an
+ * O(n) pass into 32 bytes per particle (plus the tree itself), paid
+ * again on each build. The walks rely on each leaf's particles being
+ * contiguous packed floats; reading the caller's arrays through a
+ * permutation would turn every leaf load into a gather. The caller's arrays are only read during
+ * particleTreeBuild() and may change or be freed afterwards; later calls
+ * use the copy as of the last build. A particleTree keeps that storage
+ * and its arena between builds, so rebuilding it every step stops
+ * allocating once it has warmed up. Results are always written back in
+ * the caller's order.
+ *
+ * Every function returning int returns PARTICLE_OK or a negative error. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define PARTICLE_API __attribute__((visibility("default")))
+#else
+#define PARTICLE_API
+#endif
+
+enum {
+  PARTICLE_OK = 0,
+  PARTICLE_INVALID = -1,    /* null handle or buffer, or nothing built */
+  PARTICLE_NO_MEMORY = -2,
+  PARTICLE_ERROR = -3
+};
+
+typedef struct particleTree particleTree;
+
+/* threshold is the leaf size, order 1 for monopoles, 2 to add quadrupoles. */
+PARTICLE_API particleTree* particleTreeCreate(int threshold, int order);
+PARTICLE_API void particleTreeDestroy(particleTree* tree);
+
+/* Build over a copy of n particles, see above. */
+PARTICLE_API int particleTreeBuild(particleTree* tree, size_t n,
+				   const float* x, const float* y, const float* z,
+				   size_t positionStride,
+				   const float* mass, size_t massStride);
+
+PARTICLE_API size_t particleTreeSize(const particleTree* tree);
+
+/* Gravitational acceleration of every particle of the last build, force
+ * over mass, with the usual opening angle theta. Massless particles get
+ * zero. */
+PARTICLE_API int particleTreeAccelerations(particleTree* tree, float theta,
+					   float* ax, float* ay, float* az,
+					   size_t stride);
+
+/* Neighbour search around numQueries points given as packed xyz triples.
+ * Indices are those of the particles passed to the last build. knn()
+ * writes k indices and squared distances per query, nearest first, with
+ * UINT32_MAX and infinity past the number of particles. radius() writes
+ * up to maxPerQuery indices per query and the full count found. */
+PARTICLE_API int particleTreeKnn(const particleTree* tree, const float* queries,
+				 size_t numQueries, uint32_t k,
+				 uint32_t* indices, float* dist2);
+PARTICLE_API int particleTreeRadius(const particleTree* tree, const float* queries,
+				    size_t numQueries, float radius, uint32_t maxPerQuery,
+				    uint32_t* indices, uint32_t* counts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PARTICLE_API_H */
@@ -0,0 +1,73 @@
+#include "octTree.h"
+#include "initialConditions.h"
+#include "directForce.h"
+#include "compactTree.h"
+
+// Checks that adding quadrupoles lowers the force error against direct
+// summation, on every walk over the SoA tree and on the pointer walk,
+// for a ball, a disk and clusters at a loose and a tight opening angle.
+// Run by ctest.
+
+enum walk_e { PARTICLE, GROUP, COMPACT, POINTER };
+const char* walkNames[] = { "particle", "group", "compact", "pointer" };
+
+forceError treeError(const vector<Node>& nodes, const vector<uint32_t>& sample,
+		     const vector<glm::vec3>& reference, walk_e walk, float theta, int order) {
+  const int threshold = 16;
+  otPool pool;
+  otNode root(threshold, &pool);
+  vector<glm::vec3> tree;
+  vector<Node> work = nodes;
+  if (walk == POINTER) {
+    root.insertSorted(work);
+    root.updateStats(true, nullptr, order);
+    root.calcForces(work, theta);
+    for (auto s : sample)
+      tree.push_back(work[s].velocity);
+  }
+  else {
+    Particles p;
+    p.fromNodes(work);
+    root.insertSorted(p);
+    root.updateStats(true, &p, order);
+    if (walk == PARTICLE)
+      root.calcForces(p, theta);
+    else if (walk == GROUP)
+      root.calcForcesGrouped(p, theta);
+    else {
+      compactTree c;
+      c.build(root);
+      c.calcForces(p, theta);
+    }
+    vector<glm::vec3> byId(p.size());
+    for (size_t i = 0; i < p.size(); ++i)
+      byId[p.id[i]] = glm::vec3(p.vx[i], p.vy[i], p.vz[i]);
+    for (auto s : sample)
+      tree.push_back(byId[s]);
+  }
+  return compareForces(reference, tree);
+}
+
+int main() {
+  const size_t numNodes = 30000;
+  bool ok = true;
+  for (auto d : { BALL, DISK, CLUSTERS }) {
+    vector<Node> nodes(numNodes);
+    initialConditions(nodes, d, 1);
+    vector<uint32_t> sample = sampleIndices(nodes.size(), 300);
+    vector<glm::vec3> reference = directForces(nodes, sample);
+    for (float theta : { 0.7f, 1.5f }) {
+      for (auto walk : { PARTICLE, GROUP, COMPACT, POINTER }) {
+	double mono = treeError(nodes, sample, reference, walk, theta, 1).rms;
+	double quad = treeError(nodes, sample, reference, walk, theta, 2).rms;
+	bool better = quad < mono;
+	cout << distributionName(d) << " theta " << theta << " " << walkNames[walk]
+	     << " rms order 1 " << mono << " order 2 " << quad
+	     << (better ? " ok" : " FAIL") << endl;
+	ok = ok && better;
+      }
+    }
+  }
+  cout << (ok ? "ok" : "FAIL") << endl;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "octTree.h"
+
+// Binary snapshots of the particle state.
+//
+// A snapshot is a fixed header padded to one page followed by the raw
+// Node array, so a restart can mmap the file and hand the array straight
+// to the tree without parsing or copying it. The header records the Node
+// layout it was written with and a restart refuses anything else.
+//
+// The array may instead be stored compressed: the bytes of every
+// shuffleBlock particles are regrouped by their position within a 4 byte
+// word, which puts the slowly varying exponent bytes of the floats next
+// to each other, and the result deflated. Such a snapshot is inflated
+// into memory on restart instead of being mapped.
+//
+// Version 2: Node::id replaces the unused padding word. Snapshots written
+// before compression existed have zeros in its fields and read as raw.
+struct snapshotHeader {
+  static const uint32_t currentVersion = 2;
+  static const size_t dataOffset = 4096;
+
+  char magic[8] = { 'P', 'A', 'R', 'T', 'S', 'N', 'A', 'P' };
+  uint32_t version = currentVersion;
+  uint32_t nodeSize = sizeof(Node);
+  uint64_t count = 0;
+  uint64_t iteration = 0;
+  int32_t threshold = 0;
+  float theta = 0;
+  uint32_t compression = 0;   // 0 raw, 1 shuffled and deflated
+  uint32_t shuffleBlock = 0;  // particles per shuffled block
+  uint64_t storedBytes = 0;   // size of the compressed array
+
+  bool valid() const {
+    return memcmp(magic, snapshotHeader().magic, sizeof(magic)) == 0 &&
+      version == currentVersion && nodeSize == sizeof(Node);
+  }
+};
+
+// Write everything in large sequential chunks, retrying short writes.
+inline bool writeAll(int fd, const char* data, size_t size) {
+  const size_t chunk = 64 << 20;
+  while (size > 0) {
+    ssize_t n = ::write(fd, data, min(size, chunk));
+    if (n < 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Regroup the bytes of n 4 byte words so that byte b of word w lands at
+// b * n + w, and back.
+inline void shuffleWords(const char* in, char* out, size_t n) {
+  for (size_t w = 0; w < n; ++w)
+    for (int b = 0; b < 4; ++b)
+      out[b * n + w] = in[w * 4 + b];
+}
+inline void unshuffleWords(const char* in, char* out, size_t n) {
+  for (size_t w = 0; w < n; ++w)
+    for (int b = 0; b < 4; ++b)
+      out[w * 4 + b] = in[b * n + w];
+}
+
+// Shuffle and deflate nodes into fd in large sequential writes, adding
+// the number of bytes written to written. No particles write nothing.
+inline bool writeCompressed(int fd, nodeArray nodes, size_t block, int level,
+			    uint64_t& written) {
+  const size_t outChunk = 8 << 20;
+  vector<char> shuffled(block * sizeof(Node));
+  vector<char> out(outChunk);
+  z_stream z = {};
+  if (deflateInit(&z, level) != Z_OK)
+    return false;
+  bool ok = true;
+  for (size_t first = 0; ok && first < nodes.size(); first += block) {
+    size_t n = min(block, nodes.size() - first);
+    size_t bytes = n * sizeof(Node);
+    shuffleWords(reinterpret_cast<const char*>(nodes.data() + first), shuffled.data(),
+		 bytes / 4);
+    z.next_in = reinterpret_cast<Bytef*>(shuffled.data());
+    z.avail_in = bytes;
+    int flush = first + n == nodes.size() ? Z_FINISH : Z_NO_FLUSH;
+    int rc;
+    do {
+      z.next_out = reinterpret_cast<Bytef*>(out.data());
+      z.avail_out = out.size();
+      rc = deflate(&z, flush);
+      size_t have = out.size() - z.avail_out;
+      ok = rc != Z_STREAM_ERROR && writeAll(fd, out.data(), have);
+      written += have;
+    } while (ok && z.avail_out == 0);
+  }
+  deflateEnd(&z);
+  return ok;
+}
+
+// Write to a temporary file and rename it into place, so a crash while
+// checkpointing never clobbers the previous snapshot. level 0 writes the
+// raw array, 1 to 9 compresses it at that zlib level.
+inline bool writeSnapshot(const string& path, nodeArray nodes,
+			  const snapshotHeader& params, int level = 0) {
+  snapshotHeader h = params;
+  h.count = nodes.size();
+  h.compression = level > 0;
+  h.shuffleBlock = level > 0 ? 1 << 20 : 0;
+
+  string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    cerr << "snapshot: cannot create " << tmp << ": " << strerror(errno) << endl;
+    return false;
+  }
+  // The header goes in last, once the compressed size is known.
+  char page[snapshotHeader::dataOffset] = {};
+  bool ok = writeAll(fd, page, sizeof(page));
+  if (ok && h.compression) {
+    h.storedBytes = 0;
+    ok = writeCompressed(fd, nodes, h.shuffleBlock, level, h.storedBytes);
+  }
+  else if (ok) {
+    h.storedBytes = nodes.size() * sizeof(Node);
+    ok = writeAll(fd, reinterpret_cast<const char*>(nodes.data()), h.storedBytes);
+  }
+  memcpy(page, &h, sizeof(h));
+  ok = ok && ::pwrite(fd, page, sizeof(page), 0) == ssize_t(sizeof(page));
+  ok = ::fsync(fd) == 0 && ok;
+  ok = ::close(fd) == 0 && ok;
+  if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+    cerr << "snapshot: cannot write " << path << ": " << strerror(errno) << endl;
+    ::unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Background snapshot output. write() copies the particles into a spare
+// buffer and returns; a writer thread compresses and writes them while
+// the simulation goes on with the next step. At most depth snapshots are
+// in flight, and write() only waits when that many are, counting each
+// such wait in stalls. Buffers are recycled, so after the first depth
+// snapshots output allocates nothing.
+class snapshotWriter {
+public:
+  atomic<size_t> stalls{0};
+  atomic<size_t> written{0};
+  atomic<size_t> failed{0};
+
+  snapshotWriter(size_t depth = 2, int level = 0)
+    : depth(max(depth, size_t(1))), level(level), worker([this] { run(); })
+  { }
+  snapshotWriter(const snapshotWriter&) = delete;
+  snapshotWriter& operator=(const snapshotWriter&) = delete;
+  ~snapshotWriter() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stop = true;
+    }
+    wake.notify_all();
+    worker.join();
+  }
+
+  void write(const string& path, nodeArray nodes, const snapshotHeader& params) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (pending() >= depth) {
+      stalls++;
+      done.wait(guard, [&] { return pending() < depth; });
+    }
+    job j;
+    if (!spare.empty()) {
+      j.nodes.swap(spare.back());
+      spare.pop_back();
+    }
+    guard.unlock();
+
+    j.path = path;
+    j.header = params;
+    j.nodes.resize(nodes.size());
+    std::copy(std::execution::par_unseq, nodes.begin(), nodes.end(), j.nodes.begin());
+
+    guard.lock();
+    queue.push_back(std::move(j));
+    guard.unlock();
+    wake.notify_one();
+  }
+
+  // Wait until everything queued so far is on disk.
+  void flush() {
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&] { return pending() == 0; });
+  }
+
+private:
+  struct job {
+    string path;
+    vector<Node> nodes;
+    snapshotHeader header;
+  };
+
+  size_t depth;
+  int level;
+  std::mutex lock;
+  std::condition_variable wake;   // work for the writer
+  std::condition_variable done;   // a snapshot finished
+  std::deque<job> queue;
+  vector<vector<Node>> spare;
+  bool busy = false;
+  bool stop = false;
+  std::thread worker;
+
+  size_t pending() const { return queue.size() + busy; }
+
+  void run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+      wake.wait(guard, [&] { return stop || !queue.empty(); });
+      if (queue.empty())
+	return;
+      job j = std::move(queue.front());
+      queue.pop_front();
+      busy = true;
+      guard.unlock();
+
+      if (writeSnapshot(j.path, j.nodes, j.header, level))
+	written++;
+      else
+	failed++;
+
+      guard.lock();
+      spare.push_back(std::move(j.nodes));
+      busy = false;
+      done.notify_all();
+    }
+  }
+};
+
+// A snapshot mapped for restart. The mapping is private, so the run can
+// update the particles in place without touching the file; only the
+// pages it actually touches are ever read in.
+class snapshotMap {
+public:
+  snapshotHeader header;
+
+  snapshotMap() { }
+  snapshotMap(const snapshotMap&) = delete;
+  snapshotMap& operator=(const snapshotMap&) = delete;
+  ~snapshotMap() {
+    if (base != MAP_FAILED)
+      ::munmap(base, length);
+  }
+
+  bool open(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      cerr << "snapshot: cannot open " << path << ": " << strerror(errno) << endl;
+      return false;
+    }
+    struct stat st;
+    bool ok = ::fstat(fd, &st) == 0 && size_t(st.st_size) >= snapshotHeader::dataOffset;
+    if (ok) {
+      length = st.st_size;
+      base = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      ok = base != MAP_FAILED;
+    }
+    ::close(fd);
+    if (!ok) {
+      cerr << "snapshot: cannot map " << path << endl;
+      return false;
+    }
+
+    memcpy(&header, base, sizeof(header));
+    size_t stored = header.compression ? header.storedBytes : header.count * sizeof(Node);
+    if (!header.valid() || header.compression > 1 ||
+	(header.compression && header.shuffleBlock == 0) ||
+	length < snapshotHeader::dataOffset + stored) {
+      cerr << "snapshot: " << path << " is not a version "
+	   << snapshotHeader::currentVersion << " snapshot of this build" << endl;
+      return false;
+    }
+    if (header.compression)
+      return inflateAll(path, stored);
+    // Start paging the particles in while the caller sets up.
+    ::madvise(base, length, MADV_WILLNEED);
+    return true;
+  }
+
+  nodeArray nodes() const {
+    if (header.compression)
+      return nodeArray(const_cast<Node*>(inflated.data()), inflated.size());
+    return nodeArray(reinterpret_cast<Node*>(static_cast<char*>(base) +
+					     snapshotHeader::dataOffset),
+		     header.count);
+  }
+
+private:
+  void* base = MAP_FAILED;
+  size_t length = 0;
+  vector<Node> inflated;
+
+  bool inflateAll(const string& path, size_t stored) {
+    ::madvise(base, length, MADV_SEQUENTIAL);
+    inflated.resize(header.count);
+    vector<char> block(size_t(header.shuffleBlock) * sizeof(Node));
+    z_stream z = {};
+    bool ok = inflateInit(&z) == Z_OK;
+    z.next_in = reinterpret_cast<Bytef*>(static_cast<char*>(base) + snapshotHeader::dataOffset);
+    size_t left = stored;
+    for (size_t first = 0; ok && first < inflated.size(); first += header.shuffleBlock) {
+      size_t bytes = min(size_t(header.shuffleBlock), inflated.size() - first) * sizeof(Node);
+      z.next_out = reinterpret_cast<Bytef*>(block.data());
+      z.avail_out = bytes;
+      while (ok && z.avail_out > 0) {
+	// avail_in is 32 bits, so a payload over 4 GiB goes in in pieces.
+	if (z.avail_in == 0) {
+	  z.avail_in = uInt(min<size_t>(left, UINT_MAX));
+	  left -= z.avail_in;
+	}
+	int rc = inflate(&z, Z_SYNC_FLUSH);
+	ok = (rc == Z_OK && (z.avail_in > 0 || left > 0 || z.avail_out == 0)) ||
+	  (rc == Z_STREAM_END && z.avail_out == 0);
+      }
+      if (ok)
+	unshuffleWords(block.data(), reinterpret_cast<char*>(inflated.data() + first),
+		       bytes / 4);
+    }
+    inflateEnd(&z);
+    // The mapping is no longer needed.
+    ::munmap(base, length);
+    base = MAP_FAILED;
+    if (!ok) {
+      cerr << "snapshot: " << path << " is corrupt" << endl;
+      inflated.clear();
+    }
+    return ok;
+  }
+};